@@ -22,6 +22,7 @@ static unsigned long long controller_counter = 0;
 // Redis keys:
 // - write:
 static std::string JOINT_TORQUES_COMMANDED_KEY = "";
+static std::string JOINT_TORQUES_VERSION_KEY = "";  // Written after the torques (simulator --command-version)
 
 // - read:
 static std::string JOINT_ANGLES_KEY  = "";
@@ -53,6 +54,7 @@ int main(int argc, char** argv) {
 	// Parse command line and set redis keys //project;robot;key
 	parseCommandline(argc, argv);
 	JOINT_TORQUES_COMMANDED_KEY = "screwCapTask::" + robot_name + "::actuators::fgc";
+	JOINT_TORQUES_VERSION_KEY   = "screwCapTask::" + robot_name + "::actuators::fgc_version";
 	JOINT_ANGLES_KEY            = "screwCapTask::" + robot_name + "::sensors::q";
 	JOINT_VELOCITIES_KEY        = "screwCapTask::" + robot_name + "::sensors::dq";
 	TIMESTAMP_KEY               = "screwCapTask::" + robot_name + "::timestamp";
@@ -156,7 +158,7 @@ int main(int argc, char** argv) {
 
 		// Send torques
 		redis_client.setEigenMatrixDerivedString(JOINT_TORQUES_COMMANDED_KEY, command_torques);
-		controller_counter++;
+		redis_client.setCommandIs(JOINT_TORQUES_VERSION_KEY, to_string(++controller_counter));
 	}
 	cout << "Initial joint configuration reached. Switching to OPERATIONAL SPACE controller." << endl;
 
@@ -252,12 +254,12 @@ int main(int argc, char** argv) {
 	
 		//------ Send torques
 		redis_client.setEigenMatrixDerivedString(JOINT_TORQUES_COMMANDED_KEY, command_torques);
-
-		controller_counter++;
+		redis_client.setCommandIs(JOINT_TORQUES_VERSION_KEY, to_string(++controller_counter));
 	}
 
 	command_torques.setZero();
 	redis_client.setEigenMatrixDerivedString(JOINT_TORQUES_COMMANDED_KEY, command_torques);
+	redis_client.setCommandIs(JOINT_TORQUES_VERSION_KEY, to_string(++controller_counter));
 
 	// show  time stats 
     double end_time = timer.elapsedTime();
@@ -265,6 +267,7 @@ int main(int argc, char** argv) {
     std::cout << "Loop run time  : " << end_time << " seconds\n";
     std::cout << "Loop updates   : " << timer.elapsedCycles() << "\n";
     std::cout << "Loop frequency : " << timer.elapsedCycles()/end_time << "Hz\n";
+    std::cout << "Loop timing    : " << timer.statistics().toString() << "\n";
 
 	return 0;
 }
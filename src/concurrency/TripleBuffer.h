@@ -0,0 +1,99 @@
+/**
+ * TripleBuffer.h
+ *
+ * Lock-free exchange of the latest value between two threads.
+ */
+
+#ifndef SAI_TRIPLE_BUFFER_H
+#define SAI_TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Hand the latest value from one producer thread to one consumer thread.
+ *
+ *   TripleBuffer<Snapshot> buffer;
+ *
+ *   // Producer
+ *   read(buffer.writeBuffer());
+ *   buffer.publish();
+ *
+ *   // Consumer
+ *   if (buffer.update()) use(buffer.readBuffer());
+ *
+ * The producer fills its own buffer and swaps it with the middle one. The
+ * consumer swaps its buffer with the middle one when that holds a newer
+ * value. Neither side waits for the other or copies values: the producer
+ * may publish faster than the consumer reads, and the consumer always gets
+ * the newest complete value. Values published in between are skipped.
+ *
+ * The three buffers are copies of the value given to the constructor, so
+ * dynamic-size members keep their storage and filling them does not
+ * allocate.
+ */
+template<typename T>
+class TripleBuffer {
+
+public:
+
+	explicit TripleBuffer(const T& value = T()) : buffers_{{value, value, value}} {}
+
+	TripleBuffer(const TripleBuffer&) = delete;
+	TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+	/**
+	 * Buffer the producer fills before publish(). Producer only.
+	 */
+	T& writeBuffer() { return buffers_[write_]; }
+
+	/**
+	 * Make the write buffer the newest value. Producer only.
+	 */
+	void publish() {
+		uint8_t middle = middle_.exchange(write_ | kFresh, std::memory_order_acq_rel);
+		write_ = middle & kIndexMask;
+	}
+
+	/**
+	 * Whether a value newer than the read buffer has been published.
+	 */
+	bool hasUpdate() const {
+		return middle_.load(std::memory_order_acquire) & kFresh;
+	}
+
+	/**
+	 * Make the newest published value the read buffer. Consumer only.
+	 *
+	 * @return  False if nothing was published since the last update(). The
+	 *          read buffer is unchanged then.
+	 */
+	bool update() {
+		if (!hasUpdate()) return false;
+		uint8_t middle = middle_.exchange(read_, std::memory_order_acq_rel);
+		read_ = middle & kIndexMask;
+		return true;
+	}
+
+	/**
+	 * Newest value taken by update(). Consumer only.
+	 */
+	const T& readBuffer() const { return buffers_[read_]; }
+
+protected:
+
+	static const uint8_t kIndexMask = 0x3;
+	static const uint8_t kFresh = 0x4;  // Middle buffer not taken by the consumer yet
+
+	std::array<T, 3> buffers_;
+
+	// Each index is only used by its own thread. The middle index and the
+	// fresh flag are swapped atomically.
+	uint8_t write_ = 0;
+	std::atomic<uint8_t> middle_{1};
+	uint8_t read_ = 2;
+
+};
+
+#endif  // SAI_TRIPLE_BUFFER_H
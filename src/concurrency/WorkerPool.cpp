@@ -0,0 +1,102 @@
+#include "WorkerPool.h"
+
+#include <chrono>
+
+WorkerPool::WorkerPool(unsigned int num_threads, int64_t spin_ns) :
+	spin_ns_(spin_ns),
+	generation_(0),
+	num_active_(0),
+	stopped_(false),
+	next_(0)
+{
+	if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+	for (unsigned int i = 1; i < num_threads; i++) {
+		threads_.emplace_back(&WorkerPool::workerLoop, this);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopped_ = true;
+	}
+	cv_start_.notify_all();
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+}
+
+template<typename Predicate>
+void WorkerPool::spinWait(Predicate done) const {
+	if (spin_ns_ <= 0) return;
+	auto t_end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(spin_ns_);
+	while (!done() && std::chrono::steady_clock::now() < t_end) {
+		std::this_thread::yield();
+	}
+}
+
+void WorkerPool::parallelFor(size_t n, const std::function<void(size_t)>& task) {
+	if (n == 0) return;
+
+	// Nothing to share
+	if (threads_.empty() || n == 1) {
+		for (size_t i = 0; i < n; i++) task(i);
+		return;
+	}
+
+	// Publish the loop and wake up the workers
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		task_ = &task;
+		n_ = n;
+		next_ = 0;
+		num_active_ = threads_.size();
+		exception_ = nullptr;
+		++generation_;
+	}
+	cv_start_.notify_all();
+
+	// Work on the loop until it is handed out, then wait for the workers
+	runTasks();
+	spinWait([this]() { return num_active_ == 0; });
+	std::exception_ptr exception;
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_done_.wait(lock, [this]() { return num_active_ == 0; });
+		task_ = nullptr;
+		exception = exception_;
+	}
+	if (exception) std::rethrow_exception(exception);
+}
+
+void WorkerPool::workerLoop() {
+	uint64_t generation = 0;
+	while (true) {
+		spinWait([&]() { return stopped_ || generation_ != generation; });
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_start_.wait(lock, [&]() { return stopped_ || generation_ != generation; });
+			if (stopped_) return;
+			generation = generation_;
+		}
+
+		runTasks();
+
+		// Notify under the lock so the caller cannot miss it between its check and its wait
+		if (--num_active_ == 0) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			cv_done_.notify_one();
+		}
+	}
+}
+
+void WorkerPool::runTasks() {
+	for (size_t i = next_++; i < n_; i = next_++) {
+		try {
+			(*task_)(i);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!exception_) exception_ = std::current_exception();
+		}
+	}
+}
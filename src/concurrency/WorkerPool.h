@@ -0,0 +1,88 @@
+/**
+ * WorkerPool.h
+ *
+ * Fixed pool of threads for data-parallel loops.
+ */
+
+#ifndef SAI_WORKER_POOL_H
+#define SAI_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Run the iterations of a loop on a fixed set of threads.
+ *
+ *   WorkerPool pool(4);
+ *   pool.parallelFor(worlds.size(), [&](size_t i) {
+ *     worlds[i].step();
+ *   });
+ *
+ * The calling thread works on the loop as well, so a pool of size N starts
+ * N - 1 threads. Iterations are handed out one at a time, so uneven
+ * iterations balance themselves.
+ *
+ * Waking a sleeping thread takes tens of microseconds. For loops issued at
+ * kHz rates, give the pool a spin window: idle workers and the waiting
+ * caller then poll for that long before they sleep.
+ */
+class WorkerPool {
+
+public:
+
+	/**
+	 * @param num_threads  Threads working on a loop, including the caller.
+	 *                     0 uses one per hardware thread.
+	 * @param spin_ns      Time to busy-wait for work or completion before
+	 *                     sleeping, in nanoseconds.
+	 */
+	explicit WorkerPool(unsigned int num_threads = 0, int64_t spin_ns = 0);
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	/**
+	 * Number of threads working on a loop, including the caller.
+	 */
+	size_t size() const { return threads_.size() + 1; }
+
+	/**
+	 * Call task(i) for every i in [0, n) and return when all calls are done.
+	 * The first exception thrown by a task is rethrown here.
+	 */
+	void parallelFor(size_t n, const std::function<void(size_t)>& task);
+
+protected:
+
+	void workerLoop();
+	void runTasks();
+
+	// Busy-wait up to spin_ns_ until done() returns true
+	template<typename Predicate>
+	void spinWait(Predicate done) const;
+
+	std::vector<std::thread> threads_;
+	const int64_t spin_ns_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_start_;
+	std::condition_variable cv_done_;
+	std::atomic<uint64_t> generation_;  // Incremented for every loop
+	std::atomic<size_t> num_active_;    // Workers still running the current loop
+	std::atomic<bool> stopped_;
+
+	const std::function<void(size_t)> *task_ = nullptr;
+	size_t n_ = 0;
+	std::atomic<size_t> next_;
+	std::exception_ptr exception_;
+
+};
+
+#endif  // SAI_WORKER_POOL_H
@@ -1,5 +1,8 @@
 #include "DemoProject.h"
 
+#include <cctype>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 
 #include <signal.h>
@@ -12,85 +15,449 @@ static inline bool isnan(const Eigen::MatrixBase<Derived>& x) {
 	return (x.array() != x.array()).any();
 }
 
+// Format like std::to_string() into an existing string, without allocating
+static inline void formatValue(std::string& s, double value) {
+	char buffer[64];
+	int len = snprintf(buffer, sizeof(buffer), "%f", value);
+	s.assign(buffer, (len > 0 && len < static_cast<int>(sizeof(buffer))) ? len : 0);
+}
+
+static inline void formatValue(std::string& s, long long value) {
+	char buffer[32];
+	int len = snprintf(buffer, sizeof(buffer), "%lld", value);
+	s.assign(buffer, len > 0 ? len : 0);
+}
+
 using namespace std;
 
+/**
+ * DemoProject::running()
+ * ----------------------
+ * Whether the I/O and compute threads should keep running.
+ */
+template<int DOF>
+bool DemoProject<DOF>::running() const {
+	return g_runloop && running_;
+}
+
+/**
+ * DemoProject::ioLoop()
+ * ---------------------
+ * I/O thread: read the sensors every cycle, hand them to the compute thread
+ * and send its command back to Redis.
+ */
+template<int DOF>
+void DemoProject<DOF>::ioLoop() {
+	// Counters only count the thread that opens them
+	if (io_perf_enabled_) io_perf_.enable();
+
+	while (running()) {
+		// Count heap allocations of each cycle once the compute thread does
+		if (allocation_check_ && !checkIoAllocations()) break;
+
+		// Wait for next scheduled loop (controller must run at precise rate)
+		if (lockstep_) {
+			if (!waitForSimulationStep()) break;
+		} else {
+			timer_.waitForNextLoop();
+		}
+		++controller_counter_;
+		trace_.setCycle(TRACE_TRACK_IO, controller_counter_);
+
+		// Get latest sensor values from Redis
+		try {
+			io_perf_.begin(IO_PERF_READ);
+			trace_.begin(TRACE_TRACK_IO, TRACE_READ);
+			readRedisValues();
+			trace_.end(TRACE_TRACK_IO, TRACE_READ);
+			io_perf_.end(IO_PERF_READ);
+		} catch (std::exception& e) {
+			if (redis_synchronized_) {
+				std::cout << e.what() << " Aborting..." << std::endl;
+				break;
+			}
+			std::cout << e.what() << " Waiting..." << std::endl;
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			continue;
+		}
+
+		// Send command torques once the compute thread has answered. A late
+		// command is sent in the next cycle, except in lockstep, where the
+		// step is only acknowledged and the next one read with its command.
+		if (!waitForCommand(controller_counter_)) continue;
+		try {
+			io_perf_.begin(IO_PERF_WRITE);
+			trace_.begin(TRACE_TRACK_IO, TRACE_WRITE);
+			writeRedisValues();
+			trace_.end(TRACE_TRACK_IO, TRACE_WRITE);
+			io_perf_.end(IO_PERF_WRITE);
+		} catch (std::exception& e) {
+			std::cout << e.what() << " Aborting..." << std::endl;
+			break;
+		}
+	}
+
+	// Stop the compute thread as well
+	if (allocation_check_) AllocationCounter::stop();
+	running_ = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	cv_.notify_all();
+}
+
+/**
+ * DemoProject::waitForSimulationStep()
+ * ------------------------------------
+ * Lockstep mode: block until the simulator publishes a step that has not
+ * been acknowledged yet and set the timer's clock to its timestamp.
+ * Returns false if the loop is stopped while waiting.
+ */
+template<int DOF>
+bool DemoProject<DOF>::waitForSimulationStep() {
+	while (running()) {
+		try {
+			{
+				AllocationCounter::Exempt hiredis;
+				redis_.pipeget(sim_step_keys_, sim_step_values_);
+			}
+			long long step = stoll(sim_step_values_[0]);
+			if (step != sim_step_acknowledged_) {
+				// A step before the last one means the simulator restored a snapshot
+				if (step < sim_step_) {
+					sim_clock_->reset(stod(sim_step_values_[1]));
+				} else {
+					sim_clock_->setTime(stod(sim_step_values_[1]));
+				}
+				sim_step_ = step;
+				return true;
+			}
+
+			// Simulator still integrating the last step
+			std::this_thread::sleep_for(std::chrono::duration<double>(kSimStepPollPeriod));
+		} catch (std::exception& e) {
+			// Simulator not running yet
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	return false;
+}
+
 /**
  * DemoProject::readRedisValues()
  * ------------------------------
- * Retrieve all read keys from Redis.
+ * I/O thread: retrieve all read keys from Redis in one pipeline and publish
+ * them to the compute thread as the newest sensor snapshot.
  */
-void DemoProject::readRedisValues() {
+template<int DOF>
+void DemoProject<DOF>::readRedisValues() {
+	{
+		AllocationCounter::Exempt hiredis;
+		redis_.pipeget(read_keys_, read_values_);
+	}
+
 	// Read from Redis current sensor values
-	robot->_q = redis_.getEigenMatrix(KEY_JOINT_POSITIONS);
-	robot->_dq = redis_.getEigenMatrix(KEY_JOINT_VELOCITIES);
+	SensorSnapshot& snapshot = snapshot_buffer_.writeBuffer();
+	RedisClient::decodeEigenMatrix(read_values_[READ_JOINT_POSITIONS], snapshot.q);
+	RedisClient::decodeEigenMatrix(read_values_[READ_JOINT_VELOCITIES], snapshot.dq);
+	RedisClient::decodeEigenMatrix(read_values_[READ_6D_SENSOR_FORCE], snapshot.F_sensor_6d);
 
 	// Get current simulation timestamp from Redis
 	// t_curr_ = stod(redis_.get(KEY_TIMESTAMP));
 
-	// Read in KP and KV from Redis (can be changed on the fly in Redis)
-	kp_pos_ = stod(redis_.get(KEY_KP_POSITION));
-	kv_pos_ = stod(redis_.get(KEY_KV_POSITION));
-	kp_ori_ = stod(redis_.get(KEY_KP_ORIENTATION));
-	kv_ori_ = stod(redis_.get(KEY_KV_ORIENTATION));
-	kp_joint_ = stod(redis_.get(KEY_KP_JOINT));
-	kv_joint_ = stod(redis_.get(KEY_KV_JOINT));
-	kp_joint_init_ = stod(redis_.get(KEY_KP_JOINT_INIT));
-	kv_joint_init_ = stod(redis_.get(KEY_KV_JOINT_INIT));
-	kp_screw_ = stod(redis_.get(KEY_KP_SCREW));
-	kv_screw_ = stod(redis_.get(KEY_KV_SCREW));
-	kp_sliding_ = stod(redis_.get(KEY_KP_SLIDING));
-	kp_bias_ = stod(redis_.get(KEY_KP_BIAS));
-	exp_moreSpeed = stod(redis_.get(KEY_MORE_SPEED));
-	exp_lessDamping = stod(redis_.get(KEY_LESS_DAMPING));
-	kp_ori_exp = stod(redis_.get(KEY_KP_ORIENTATION_EXP));
-	kv_ori_exp = stod(redis_.get(KEY_KV_ORIENTATION_EXP));
-	ki_ori_exp = stod(redis_.get(KEY_KI_ORIENTATION_EXP));
-	kp_pos_exp = stod(redis_.get(KEY_KP_POSITION_EXP));
-
-	Eigen::VectorXd F_sensor_6d = redis_.getEigenMatrix(Optoforce::KEY_6D_SENSOR_FORCE);
+	// Keep the control loop phase-locked to the driver's sample publishing
+	if (phase_lock_) {
+		timer_.updatePhaseReference(stod(read_values_[READ_PUBLISH_TIME]));
+	}
+
+	// Read in the UI flag and KP and KV from Redis (can be changed on the fly in Redis)
+	for (int i = READ_UI_FLAG; i < READ_PUBLISH_TIME; i++) {
+		snapshot.values[i] = stod(read_values_[i]);
+	}
+
+	snapshot.cycle = controller_counter_;
+	snapshot.sim_step = sim_step_;
+	// The timer only tracks its loop time in waitForNextLoop(), so in lockstep
+	// stamp the snapshot with the simulation time of the step
+	snapshot.t = lockstep_ ? sim_clock_->time() : timer_.elapsedTime();
+
+	// Hand the snapshot to the compute thread
+	snapshot_buffer_.publish();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	cv_.notify_all();
+}
+
+/**
+ * DemoProject::waitForSnapshot()
+ * ------------------------------
+ * Compute thread: block until the I/O thread publishes a sensor snapshot
+ * and take the newest one. Returns false if the loop is stopped while
+ * waiting.
+ */
+template<int DOF>
+bool DemoProject<DOF>::waitForSnapshot() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!snapshot_buffer_.update()) {
+		if (!running()) return false;
+
+		// Ctrl-C does not notify cv_, so check g_runloop periodically
+		cv_.wait_for(lock, std::chrono::milliseconds(10));
+	}
+	return true;
+}
+
+/**
+ * DemoProject::readSnapshot()
+ * ---------------------------
+ * Compute thread: copy the sensor snapshot into the model and the gains.
+ */
+template<int DOF>
+void DemoProject<DOF>::readSnapshot() {
+	const SensorSnapshot& snapshot = snapshot_buffer_.readBuffer();
+	command_cycle_ = snapshot.cycle;
+	command_sim_step_ = snapshot.sim_step;
+	t_curr_ = snapshot.t;
+
+	robot->_q = snapshot.q;
+	robot->_dq = snapshot.dq;
+
+	ui_flag_ = static_cast<int>(snapshot.values[READ_UI_FLAG]);
+	kp_pos_ = snapshot.values[READ_KP_POSITION];
+	kv_pos_ = snapshot.values[READ_KV_POSITION];
+	kp_ori_ = snapshot.values[READ_KP_ORIENTATION];
+	kv_ori_ = snapshot.values[READ_KV_ORIENTATION];
+	kp_joint_ = snapshot.values[READ_KP_JOINT];
+	kv_joint_ = snapshot.values[READ_KV_JOINT];
+	kp_joint_init_ = snapshot.values[READ_KP_JOINT_INIT];
+	kv_joint_init_ = snapshot.values[READ_KV_JOINT_INIT];
+	kp_screw_ = snapshot.values[READ_KP_SCREW];
+	kv_screw_ = snapshot.values[READ_KV_SCREW];
+	kp_sliding_ = snapshot.values[READ_KP_SLIDING];
+	kp_bias_ = snapshot.values[READ_KP_BIAS];
+	exp_moreSpeed = snapshot.values[READ_MORE_SPEED];
+	exp_lessDamping = snapshot.values[READ_LESS_DAMPING];
+	kp_ori_exp = snapshot.values[READ_KP_ORIENTATION_EXP];
+	kv_ori_exp = snapshot.values[READ_KV_ORIENTATION_EXP];
+	ki_ori_exp = snapshot.values[READ_KI_ORIENTATION_EXP];
+	kp_pos_exp = snapshot.values[READ_KP_POSITION_EXP];
+
+	F_sensor_6d_ = snapshot.F_sensor_6d;
 	
 	// Offset moment bias
-	F_sensor_6d.head(3) += Eigen::Vector3d(0.05, -0.59, -5.0);
-	F_sensor_6d.tail(3) += Eigen::Vector3d(-0.168, 0.043, -0.016);
+	F_sensor_6d_.head(3) += Eigen::Vector3d(0.05, -0.59, -5.0);
+	F_sensor_6d_.tail(3) += Eigen::Vector3d(-0.168, 0.043, -0.016);
 
 	// Transform sensor measurements to EE frame
 	R_sensor_to_ee_ << -1/sqrt(2), -1/sqrt(2), 	0,
 	                   1/sqrt(2),  -1/sqrt(2), 	0,
 	                   0, 		   0, 		  	1;
 
-	// F_sensor_ = R_sensor_to_ee_ * F_sensor_6d.head(3);
-	// M_sensor_ = R_sensor_to_ee_ * F_sensor_6d.tail(3);
-	F_sensor_ = F_sensor_6d.head(3);
-	M_sensor_ = F_sensor_6d.tail(3);
+	// F_sensor_ = R_sensor_to_ee_ * F_sensor_6d_.head(3);
+	// M_sensor_ = R_sensor_to_ee_ * F_sensor_6d_.tail(3);
+	F_sensor_ = F_sensor_6d_.head(3);
+	M_sensor_ = F_sensor_6d_.tail(3);
 
 	// Set moments to zero when they are outside of a range to avoid vibrations
 	// for (int i = 0; i<3;i++){
 	// 	if (M_sensor_(i) < 0.13 && M_sensor_(i) > -0.13){ M_sensor_(i) = 0;}
 	// }
-	
-	Eigen::VectorXd F_controller(6); //forces in EE and capped moments in EE
-	F_controller << F_sensor_, M_sensor_;
+}
 
-	redis_.setEigenMatrix(Optoforce::KEY_6D_SENSOR_FORCE + "_controller", F_controller);
+/**
+ * DemoProject::publishCommand()
+ * -----------------------------
+ * Compute thread: hand the command torques and the values plotted from
+ * Redis to the I/O thread.
+ */
+template<int DOF>
+void DemoProject<DOF>::publishCommand() {
+	ControlCommand& command = command_buffer_.writeBuffer();
+	command.cycle = command_cycle_;
+	command.sim_step = command_sim_step_;
+	command.command_torques = command_torques_;
+	command.x = x_;
+	command.x_des = x_des_;
+	command.op_point = op_point_;
+	command.theta = theta;
+	command.F_sensor_6d = F_sensor_6d_;
+
+	command_buffer_.publish();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	cv_.notify_all();
+
+	// Debug values are set again by the next cycle's controller
+	command_buffer_.writeBuffer().debug_mask = 0;
+}
+
+/**
+ * DemoProject::waitForCommand()
+ * -----------------------------
+ * I/O thread: block until the compute thread answers the snapshot of the
+ * given cycle, for at most kCommandTimeout, and take the newest command.
+ * In lockstep the simulator waits for the answer to its step, so this waits
+ * for it as long as the loop runs. Returns false if no command newer than
+ * the last one sent has arrived.
+ */
+template<int DOF>
+bool DemoProject<DOF>::waitForCommand(uint64_t cycle) {
+	auto answered = [this, cycle]() {
+		command_buffer_.update();
+		return command_buffer_.readBuffer().cycle >= cycle || !running();
+	};
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (lockstep_) {
+		// Ctrl-C does not notify cv_, so check g_runloop periodically
+		while (!cv_.wait_for(lock, std::chrono::milliseconds(10), answered)) {}
+	} else {
+		auto t_timeout = std::chrono::steady_clock::now() +
+		                 std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(kCommandTimeout));
+		cv_.wait_until(lock, t_timeout, answered);
+	}
+	return command_buffer_.readBuffer().cycle > command_written_;
 }
 
 /**
  * DemoProject::writeRedisValues()
  * -------------------------------
- * Send all write keys to Redis.
+ * I/O thread: send the newest command to Redis in one pipeline.
  */
-void DemoProject::writeRedisValues() {
+template<int DOF>
+void DemoProject<DOF>::writeRedisValues() {
+	const ControlCommand& command = command_buffer_.readBuffer();
+	command_written_ = command.cycle;
+
 	// Send end effector position and desired position
-	redis_.setEigenMatrix(KEY_EE_POS, x_);
-	redis_.setEigenMatrix(KEY_EE_POS_DES, x_des_);
+	RedisClient::encodeEigenMatrix(command.x, write_keyvals_[WRITE_EE_POS].second);
+	RedisClient::encodeEigenMatrix(command.x_des, write_keyvals_[WRITE_EE_POS_DES].second);
 
 	// angle between contact surface normal and cap normal
-	redis_.set(THETA, to_string(theta));
+	formatValue(write_keyvals_[WRITE_THETA].second, command.theta);
+
+	RedisClient::encodeEigenMatrix(command.op_point, write_keyvals_[WRITE_OP_POINT].second);
+
+	// forces in EE and capped moments in EE
+	RedisClient::encodeEigenMatrix(command.F_sensor_6d, write_keyvals_[WRITE_6D_SENSOR_FORCE_CONTROLLER].second);
+
+	// Send torques, followed by their version so a simulator holding the last
+	// command knows when to read a new one, and in lockstep the step they answer
+	RedisClient::encodeEigenMatrix(command.command_torques, write_keyvals_[WRITE_COMMAND_TORQUES].second);
+	formatValue(write_keyvals_[WRITE_COMMAND_VERSION].second, static_cast<long long>(command.cycle));
+	if (lockstep_) {
+		formatValue(write_keyvals_[WRITE_COMMAND_STEP].second, command.sim_step);
+		sim_step_acknowledged_ = command.sim_step;
+	}
+
+	AllocationCounter::Exempt hiredis;
+	redis_.pipeset(write_keyvals_);
+
+	// Intermediate values for plotting
+	for (int i = 0; i < NUM_DEBUG_VALUES; i++) {
+		if (!(command.debug_mask & (1 << i))) continue;
+		RedisClient::encodeEigenMatrix(command.debug[i], debug_value_);
+		redis_.set(debug_keys_[i], debug_value_);
+	}
+}
+
+/**
+ * DemoProject::setDebugValue()
+ * ----------------------------
+ * Send a controller's intermediate value to Redis for plotting, with the
+ * command of this cycle.
+ */
+template<int DOF>
+void DemoProject<DOF>::setDebugValue(DebugValueId id, const Eigen::Ref<const Eigen::MatrixXd>& value) {
+	ControlCommand& command = command_buffer_.writeBuffer();
+	command.debug[id] = value;
+	command.debug_mask |= 1 << id;
+}
 
-	redis_.setEigenMatrix(KukaIIWA::KEY_PREFIX + "tasks::op_point", op_point_);
+/**
+ * public DemoProject::enableLockstep()
+ * ------------------------------------
+ * Drive the loop and the timer's clock from the simulator's steps.
+ */
+template<int DOF>
+void DemoProject<DOF>::enableLockstep() {
+	lockstep_ = true;
+	sim_clock_ = make_shared<SimulationClock>();
+	timer_.setClock(sim_clock_);
+}
 
-	// Send torques
-	redis_.setEigenMatrix(KEY_COMMAND_TORQUES, command_torques_);
+/**
+ * public DemoProject::enableAllocationCheck()
+ * -------------------------------------------
+ * Count heap allocations per control cycle once the loop is warmed up.
+ */
+template<int DOF>
+void DemoProject<DOF>::enableAllocationCheck(unsigned long long warmup_cycles) {
+	if (!AllocationCounter::available()) {
+		cout << "WARNING. DemoProject. Allocation counting is only supported with glibc. Allocation check disabled." << endl;
+		return;
+	}
+	allocation_check_ = true;
+	allocation_check_warmup_ = warmup_cycles;
+}
+
+/**
+ * DemoProject::checkAllocations()
+ * -------------------------------
+ * Called at the start of every cycle. Returns false if the previous cycle
+ * allocated on the heap outside of SAI2 and hiredis.
+ */
+template<int DOF>
+bool DemoProject<DOF>::checkAllocations() {
+	if (controller_state_ == REDIS_SYNCHRONIZATION) return true;
+
+	if (allocation_check_cycles_ > allocation_check_warmup_) {
+		uint64_t num_allocations = AllocationCounter::count();
+		if (num_allocations > 0) {
+			AllocationCounter::stop();
+			cout << "Allocation check failed: " << num_allocations << " heap allocations in control cycle "
+			     << command_cycle_ << " (" << allocation_check_cycles_ - allocation_check_warmup_
+			     << " cycles after warm-up)." << endl;
+			allocation_check_failed_ = true;
+			return false;
+		}
+		allocation_check_exempt_ += AllocationCounter::exemptCount();
+	}
+	if (allocation_check_cycles_ >= allocation_check_warmup_) {
+		AllocationCounter::start();
+		allocation_check_started_ = true;
+	}
+	++allocation_check_cycles_;
+	return true;
+}
+
+/**
+ * DemoProject::checkIoAllocations()
+ * ---------------------------------
+ * I/O thread: called at the start of every cycle. Returns false if the
+ * previous cycle allocated on the heap outside of hiredis and the loop
+ * statistics.
+ */
+template<int DOF>
+bool DemoProject<DOF>::checkIoAllocations() {
+	if (!allocation_check_started_) return true;
+
+	if (io_allocation_check_cycles_ > 0) {
+		uint64_t num_allocations = AllocationCounter::count();
+		if (num_allocations > 0) {
+			AllocationCounter::stop();
+			cout << "Allocation check failed: " << num_allocations << " heap allocations in I/O cycle "
+			     << controller_counter_ << " (" << io_allocation_check_cycles_
+			     << " cycles after warm-up)." << endl;
+			allocation_check_failed_ = true;
+			return false;
+		}
+		io_allocation_check_exempt_ += AllocationCounter::exemptCount();
+	}
+	AllocationCounter::start();
+	++io_allocation_check_cycles_;
+	return true;
 }
 
 /**
@@ -98,7 +465,8 @@ void DemoProject::writeRedisValues() {
  * ----------------------------------------------------
  * Estimate pivot point from the linear and angular velocity.
  */
-Eigen::Vector3d DemoProject::estimatePivotPoint() {
+template<int DOF>
+Eigen::Vector3d DemoProject<DOF>::estimatePivotPoint() {
 	/*
  	 * Assuming the end effector is rotating about a point, we know:
  	 *
@@ -121,40 +489,124 @@ Eigen::Vector3d DemoProject::estimatePivotPoint() {
 /**
  * DemoProject::updateModel()
  * --------------------------
- * Update the robot model and all the relevant member variables.
+ * Update the robot model, the end effector kinematics and the model
+ * quantities the current controller state needs.
  */
-void DemoProject::updateModel() {
-	// Update the model
-	robot->updateModel();
+template<int DOF>
+void DemoProject<DOF>::updateModel() {
+	// SAI2 and RBDL allocate internally. The allocation check reports these
+	// separately instead of failing on them.
+	{
+		AllocationCounter::Exempt sai2;
+
+		// Update the model and query the link6 frame once
+		robot->updateModel();
+		link6_.update(*robot, "link6", robot->_dq);
+	}
 
 	// Forward kinematics
-	// robot->position(x_, "link6", Eigen::Vector3d::Zero());
-	robot->position(x_, "link6", Eigen::Vector3d(0,0,0.11));
-	robot->rotation(R_ee_to_base_, "link6");
-	// robot->linearVelocity(dx_, "link6", Eigen::Vector3d::Zero());
-	robot->linearVelocity(dx_, "link6", Eigen::Vector3d(0,0,0.11));
-	robot->angularVelocity(w_, "link6");
+	// x_ = link6_.position();
+	x_ = link6_.position(Eigen::Vector3d(0,0,0.11));
+	R_ee_to_base_ = link6_.rotation();
+	// dx_ = link6_.linearVelocity();
+	dx_ = link6_.linearVelocity(Eigen::Vector3d(0,0,0.11));
+	w_ = link6_.angularVelocity();
 	theta = acos(abs(F_sensor_.dot(Eigen::Vector3d(0,0,1))) / F_sensor_.norm());
 
-	// Jacobians
-	robot->J_0(J_cap_, "link6", Eigen::Vector3d(0,0,0.11));
-	robot->Jv(Jv_, "link6", Eigen::Vector3d::Zero());
-	robot->Jw(Jw_, "link6");
+	// Joint state and mass matrix in the controller's types
+	q_ = robot->_q;
+	dq_ = robot->_dq;
+	M_ = robot->_M;
+	dynamics_.update(M_);
 
 	op_point_ = estimatePivotPoint();
-	robot->Jv(Jv_cap_, "link6", Eigen::Vector3d(0,0,0.11));
-	robot->nullspaceMatrix(N_cap_, J_cap_);
-	robot->nullspaceMatrix(Nv_, Jv_);
-	robot->nullspaceMatrix(Nv_cap_, Jv_cap_);
-	Jw_cap_ = Jw_ * Nv_cap_;
-	robot->nullspaceMatrix(Nvw_cap_, Jw_cap_, Nv_cap_);
 
-	// Dynamics
-	robot->taskInertiaMatrixWithPseudoInv(Lambda_cap_, J_cap_);
-	robot->taskInertiaMatrixWithPseudoInv(Lambda_x_, Jv_);
-	robot->taskInertiaMatrixWithPseudoInv(Lambda_x_cap_, Jv_cap_);
-	robot->taskInertiaMatrixWithPseudoInv(Lambda_r_cap_, Jw_cap_);
-	robot->gravityVector(g_);
+	// Jacobians, nullspaces and task inertias of the current state only
+	model_valid_ = 0;
+	requireModel(modelQuantities(controller_state_));
+}
+
+/**
+ * DemoProject::modelQuantities()
+ * ------------------------------
+ * Model quantities used by the controller of each state (see runLoop()).
+ */
+template<int DOF>
+unsigned int DemoProject<DOF>::modelQuantities(ControllerState state) {
+	switch (state) {
+		case JOINT_SPACE_INITIALIZATION:
+			return MODEL_JOINT_SPACE;
+		case ALIGN_BOTTLE_CAP:
+			return MODEL_ALIGN_BOTTLE_CAP_FORCE;
+		case REWIND_BOTTLE_CAP:
+		case SCREW_BOTTLE_CAP:
+			return MODEL_SCREW_BOTTLE_CAP;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * DemoProject::requireModel()
+ * ---------------------------
+ * Compute the requested model quantities and their dependencies, unless
+ * they were already computed this cycle.
+ */
+template<int DOF>
+void DemoProject<DOF>::requireModel(unsigned int quantities) {
+	// Add dependencies, from the most derived quantities down
+	if (quantities & (MODEL_NVW_CAP | MODEL_LAMBDA_R_CAP)) quantities |= MODEL_JW_CAP;
+	if (quantities & MODEL_NVW_CAP) quantities |= MODEL_NV_CAP;
+	if (quantities & MODEL_JW_CAP) quantities |= MODEL_JW | MODEL_NV_CAP;
+	if (quantities & (MODEL_NV_CAP | MODEL_LAMBDA_X_CAP)) quantities |= MODEL_JV_CAP;
+	if (quantities & (MODEL_NV | MODEL_LAMBDA_X)) quantities |= MODEL_JV;
+	if (quantities & (MODEL_N_CAP | MODEL_LAMBDA_CAP)) quantities |= MODEL_J_CAP;
+	// A nullspace comes with the task inertia of the same Jacobian
+	if (quantities & MODEL_N_CAP) quantities |= MODEL_LAMBDA_CAP;
+	if (quantities & MODEL_NV) quantities |= MODEL_LAMBDA_X;
+	if (quantities & MODEL_NV_CAP) quantities |= MODEL_LAMBDA_X_CAP;
+	if (quantities & MODEL_NVW_CAP) quantities |= MODEL_LAMBDA_R_CAP;
+	quantities &= ~model_valid_;
+	if (!quantities) return;
+
+	// Jacobians of points on link6
+	if (quantities & MODEL_J_CAP) link6_.J_0(J_cap_, Eigen::Vector3d(0,0,0.11));
+	if (quantities & MODEL_JV) link6_.Jv(Jv_);
+	if (quantities & MODEL_JW) link6_.Jw(Jw_);
+	if (quantities & MODEL_JV_CAP) link6_.Jv(Jv_cap_, Eigen::Vector3d(0,0,0.11));
+
+	if (quantities & MODEL_GRAVITY) {
+		{
+			AllocationCounter::Exempt sai2;
+			robot->gravityVector(model_g_);
+		}
+		g_ = model_g_;
+	}
+
+	// Task inertias and nullspaces, all from one factorization of M
+	if (quantities & MODEL_N_CAP) {
+		dynamics_.taskMatrices(Lambda_cap_, N_cap_, J_cap_);
+	} else if (quantities & MODEL_LAMBDA_CAP) {
+		dynamics_.taskInertiaMatrix(Lambda_cap_, J_cap_);
+	}
+	if (quantities & MODEL_NV) {
+		dynamics_.taskMatrices(Lambda_x_, Nv_, Jv_);
+	} else if (quantities & MODEL_LAMBDA_X) {
+		dynamics_.taskInertiaMatrix(Lambda_x_, Jv_);
+	}
+	if (quantities & MODEL_NV_CAP) {
+		dynamics_.taskMatrices(Lambda_x_cap_, Nv_cap_, Jv_cap_);
+	} else if (quantities & MODEL_LAMBDA_X_CAP) {
+		dynamics_.taskInertiaMatrix(Lambda_x_cap_, Jv_cap_);
+	}
+	if (quantities & MODEL_JW_CAP) Jw_cap_.noalias() = Jw_ * Nv_cap_;
+	if (quantities & MODEL_NVW_CAP) {
+		dynamics_.taskMatrices(Lambda_r_cap_, Nvw_cap_, Jw_cap_, Nv_cap_);
+	} else if (quantities & MODEL_LAMBDA_R_CAP) {
+		dynamics_.taskInertiaMatrix(Lambda_r_cap_, Jw_cap_);
+	}
+
+	model_valid_ |= quantities;
 }
 
 /**
@@ -162,36 +614,31 @@ void DemoProject::updateModel() {
  * ----------------------------------------------
  * Controller to initialize robot to desired joint position.
  */
-DemoProject::ControllerStatus DemoProject::computeJointSpaceControlTorques() {
-	try {
-		int flag = stoi(redis_.get(KEY_UI_FLAG));
-		if (flag) return FINISHED;
-		else return RUNNING;
-	} catch (std::exception& e) {
-		cout << e.what() << endl;
-	}
-	return RUNNING;
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::computeJointSpaceControlTorques() {
+	if (ui_flag_) return FINISHED;
+	else return RUNNING;
 
 	// Joint space velocity saturation
-	Eigen::VectorXd q_err = robot->_q - q_des_;
+	VectorDof q_err = q_ - q_des_;
 	dq_des_ = -(kp_joint_init_ / kv_joint_init_) * q_err;
 	double v = kMaxVelocity / dq_des_.norm();
 	if (v > 1) v = 1;
-	Eigen::VectorXd dq_err = robot->_dq - v * dq_des_;
-	std::cout << q_err.transpose() << " " << q_err.norm() << " " << robot->_dq.norm() << std::endl;
+	VectorDof dq_err = dq_ - v * dq_des_;
+	std::cout << q_err.transpose() << " " << q_err.norm() << " " << dq_.norm() << std::endl;
 
 	// Angular momentum after initialization
 	Eigen::Vector3d w_init;
 	w_init = w_;
 
 	// Finish if the robot has converged to q_initial
-	if (q_err.norm() < kToleranceInitQ && robot->_dq.norm() < kToleranceInitDq) {
+	if (q_err.norm() < kToleranceInitQ && dq_.norm() < kToleranceInitDq) {
 		return FINISHED;
 	}
 
 	// Compute torques
-	Eigen::VectorXd ddq = -kv_joint_init_ * dq_err;
-	command_torques_ = robot->_M * ddq;
+	VectorDof ddq = -kv_joint_init_ * dq_err;
+	command_torques_.noalias() = M_ * ddq;
 	return RUNNING;
 }
 
@@ -214,7 +661,7 @@ DemoProject::ControllerStatus DemoProject::computeJointSpaceControlTorques() {
 // 	// Nullspace posture control and damping
 // 	Eigen::VectorXd q_err = robot->_q - q_des_;
 // 	Eigen::VectorXd dq_err = robot->_dq - dq_des_;
-// 	Eigen::VectorXd ddq = -kp_joint_ * q_err - kv_joint_ * dq_err;
+// 	VectorDof ddq = -kp_joint_ * q_err - kv_joint_ * dq_err;
 
 // 	// Control torques
 // 	Eigen::Vector3d F_x = Lambda_x_ * ddx;
@@ -229,13 +676,16 @@ DemoProject::ControllerStatus DemoProject::computeJointSpaceControlTorques() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::alignBottleCap() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::alignBottleCap() {
+	requireModel(MODEL_ALIGN_BOTTLE_CAP);
+
 	// Position - set xdes below the current position in z to apply a constant downward force
 	Eigen::Vector3d x_des_ee(0,0,0.025);
 	Eigen::Vector3d x_bias(0,0.005,0);
 	Eigen::Vector3d sliding_vector;
 	sliding_vector = x_des_ee.cross(M_sensor_);
-	robot->position(x_des_, "link6", x_des_ee + kp_sliding_ * sliding_vector);
+	x_des_ = link6_.position(x_des_ee + kp_sliding_ * sliding_vector);
 	x_des_ += kp_bias_ * x_bias ;
 
 	Eigen::Vector3d x_err = x_ - x_des_;
@@ -247,15 +697,15 @@ DemoProject::ControllerStatus DemoProject::alignBottleCap() {
 	Eigen::Vector3d dPhi;
 	dPhi = -R_ee_to_base_ * M_sensor_;
 	Eigen::Vector3d dw = -kp_ori_ * dPhi - kv_ori_ * w_;
-	Eigen::VectorXd ddxdw(6);
+	Vector6d ddxdw;
 	ddxdw << ddx, dw;
 
 	// Nullspace damping	
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
-	Eigen::VectorXd F_joint = robot->_M * ddq; 
+	VectorDof ddq = -kv_joint_ * dq_;
+	VectorDof F_joint = M_ * ddq; 
 
 	// Control torques
-	Eigen::VectorXd F_xw = Lambda_cap_ * ddxdw;
+	Vector6d F_xw = Lambda_cap_ * ddxdw;
 	command_torques_ = J_cap_.transpose() * F_xw + N_cap_.transpose() * F_joint;
 
 	// Finish if sensed moments and angular velocity are zero
@@ -269,13 +719,16 @@ DemoProject::ControllerStatus DemoProject::alignBottleCap() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::alignBottleCapExponentialDamping() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::alignBottleCapExponentialDamping() {
+	requireModel(MODEL_ALIGN_BOTTLE_CAP);
+
 	// Position - set xdes below the current position in z to apply a constant downward force
 	Eigen::Vector3d x_des_ee(0,0,0.025);
 	Eigen::Vector3d x_bias(0,0.005,0);
 	Eigen::Vector3d sliding_vector;
 	sliding_vector = x_des_ee.cross(M_sensor_);
-	robot->position(x_des_, "link6", x_des_ee + kp_sliding_ * sliding_vector);
+	x_des_ = link6_.position(x_des_ee + kp_sliding_ * sliding_vector);
 	x_des_ += kp_bias_ * x_bias ;
 
 	Eigen::Vector3d x_err = x_ - x_des_;
@@ -289,19 +742,19 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapExponentialDamping() {
 	integral_dPhi_ += dPhi_dt;// - vec_dPhi_[idx_vec_dPhi_];
 	vec_dPhi_[idx_vec_dPhi_] = dPhi_dt;
 	idx_vec_dPhi_ = (idx_vec_dPhi_ + 1) % kIntegraldPhiWindow;
-	redis_.setEigenMatrix("cs225a::kuka_iiwa::integral_dPhi", integral_dPhi_);
-	redis_.setEigenMatrix("cs225a::kuka_iiwa::dPhi", dPhi);
+	setDebugValue(DEBUG_INTEGRAL_DPHI, integral_dPhi_);
+	setDebugValue(DEBUG_DPHI, dPhi);
 
 	Eigen::Vector3d dw = -(1-exp(-exp_moreSpeed*theta)) *kp_ori_ * dPhi - (exp(-exp_lessDamping*theta)*kv_ori_) * w_ - ki_ori_exp * integral_dPhi_;
-	Eigen::VectorXd ddxdw(6);
+	Vector6d ddxdw;
 	ddxdw << ddx, dw;
 
 	// Nullspace damping	
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
-	Eigen::VectorXd F_joint = robot->_M * ddq; 
+	VectorDof ddq = -kv_joint_ * dq_;
+	VectorDof F_joint = M_ * ddq; 
 
 	// Control torques
-	Eigen::VectorXd F_xw = Lambda_cap_ * ddxdw;
+	Vector6d F_xw = Lambda_cap_ * ddxdw;
 	command_torques_ = J_cap_.transpose() * F_xw + N_cap_.transpose() * F_joint;
 
 	// Finish if sensed moments and angular velocity are zero
@@ -315,7 +768,10 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapExponentialDamping() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::alignBottleCapSimple() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::alignBottleCapSimple() {
+	requireModel(MODEL_ALIGN_BOTTLE_CAP);
+
 	// Position - set xdes in the opposite direction to the contact force to apply a constant F in that direction
 	Eigen::Vector3d x_des_ee;
 	if (F_sensor_.norm() < 5) {
@@ -325,7 +781,7 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapSimple() {
 		x_des_ee += Eigen::Vector3d(0,0,0.025);
 	}
 
-	robot->position(x_des_, "link6", x_des_ee);
+	x_des_ = link6_.position(x_des_ee);
 	Eigen::Vector3d x_err = x_ - x_des_;
 	Eigen::Vector3d dx_err = dx_ - dx_des_;
 	Eigen::Vector3d ddx = -kp_pos_ * x_err - kv_pos_ * dx_err;
@@ -336,13 +792,13 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapSimple() {
 	Eigen::Vector3d dw = -kp_ori_ * dPhi - kv_ori_ * w_;
 
 	// Nullspace damping	
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
-	Eigen::VectorXd F_joint = robot->_M * ddq; 
+	VectorDof ddq = -kv_joint_ * dq_;
+	VectorDof F_joint = M_ * ddq; 
 
 	// Position-orientation combined
-	Eigen::VectorXd ddxdw(6);
+	Vector6d ddxdw;
 	ddxdw << ddx, dw;
-	Eigen::VectorXd F_xw = Lambda_cap_ * ddxdw;
+	Vector6d F_xw = Lambda_cap_ * ddxdw;
 	command_torques_ = J_cap_.transpose() * F_xw + N_cap_.transpose() * F_joint;
 
 	// Orientation in nullspace of position
@@ -361,7 +817,10 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapSimple() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::alignBottleCapForce() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::alignBottleCapForce() {
+	requireModel(MODEL_ALIGN_BOTTLE_CAP_FORCE);
+
 	// Position - set xdes in the opposite direction to the contact force to apply a constant F in that direction
 	Eigen::Vector3d x_des_ee;
 	if (F_sensor_.norm() < 5) {
@@ -371,7 +830,7 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapForce() {
 		x_des_ee = Eigen::Vector3d(0,0,0.135);
 	}
 
-	robot->position(x_des_, "link6", x_des_ee);
+	x_des_ = link6_.position(x_des_ee);
 	Eigen::Vector3d x_err = x_ - x_des_;
 	Eigen::Vector3d dx_err = dx_ - dx_des_;
 	Eigen::Vector3d ddx = -kp_pos_ * x_err - kv_pos_ * dx_err;
@@ -382,17 +841,17 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapForce() {
 	Eigen::Vector3d dw = -kp_ori_ * dPhi - kv_ori_ * w_;
 
 	// Nullspace damping	
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
-	Eigen::VectorXd F_joint = robot->_M * ddq; 
+	VectorDof ddq = -kv_joint_ * dq_;
+	VectorDof F_joint = M_ * ddq; 
 
 	// // Position-orientation combined
-	// Eigen::VectorXd ddxdw(6);
+	// Vector6d ddxdw;
 	// ddxdw << ddx, dw;
-	// Eigen::VectorXd F_xw = Lambda_cap_ * ddxdw;
+	// Vector6d F_xw = Lambda_cap_ * ddxdw;
 	// command_torques_ = J_cap_.transpose() * F_xw + N_cap_.transpose() * F_joint;
 
 	// Orientation in nullspace of position
-	redis_.setEigenMatrix("sai2::kuka_iiwa::tasks::lambda_x_cap", Lambda_x_cap_);
+	setDebugValue(DEBUG_LAMBDA_X_CAP, Lambda_x_cap_);
 	Eigen::Vector3d F_x = Lambda_x_cap_ * ddx;
 	Eigen::Vector3d F_r = Lambda_r_cap_ * dw;
 	command_torques_ = Jv_cap_.transpose() * F_x + Jw_cap_.transpose() * F_r + Nvw_cap_.transpose() * F_joint;
@@ -409,12 +868,12 @@ DemoProject::ControllerStatus DemoProject::alignBottleCapForce() {
  * ----------------------------------------------------
  * Controller to check if sensed moments are zero, angular velocity is zero and Fz is smaller than -1.
  */
-DemoProject::ControllerStatus DemoProject::checkAlignment() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::checkAlignment() {
 
 	if (!((M_sensor_.norm() <= 0.1) && (w_.norm() < 0.01) && (F_sensor_(2) < -1.0))) return FAILED;
 
-	double t_curr = timer_.elapsedTime();
-	if (t_curr - t_alignment_ >= kAlignmentWait) return FINISHED;
+	if (t_curr_ - t_alignment_ >= kAlignmentWait) return FINISHED;
 
 	return RUNNING;
 }
@@ -424,29 +883,32 @@ DemoProject::ControllerStatus DemoProject::checkAlignment() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::rewindBottleCap() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::rewindBottleCap() {
+	requireModel(MODEL_SCREW_BOTTLE_CAP);
+
 	// Position - set xdes below the current position in z to apply a constant downward force
-	robot->position(x_des_, "link6", Eigen::Vector3d(0,0,0.16));
+	x_des_ = link6_.position(Eigen::Vector3d(0,0,0.16));
 	Eigen::Vector3d x_err = x_ - x_des_;
 	Eigen::Vector3d dx_err = dx_ - dx_des_;
 	Eigen::Vector3d ddx = -kp_pos_ * x_err - kv_pos_ * dx_err;
 
 	// Finish if the robot has converged to the last joint limit (+15deg)
-	double q_screw_err = robot->_q(6) - (-KukaIIWA::JOINT_LIMITS(6) + 15.0 * M_PI / 180.0);
+	double q_screw_err = q_(6) - (-KukaIIWA::JOINT_LIMITS(6) + 15.0 * M_PI / 180.0);
 	if (abs(q_screw_err) < 0.1) return FINISHED;
 
 	//Joint space velocity saturation
 	double dq_screw_des = -(kp_screw_ / kv_screw_) * q_screw_err;
 	double v = kMaxVelocity / abs(dq_screw_des);
 	if (v > 1) v = 1;
-	double dq_screw_err = robot->_dq(6) - v * dq_screw_des;
+	double dq_screw_err = dq_(6) - v * dq_screw_des;
 
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
+	VectorDof ddq = -kv_joint_ * dq_;
 	ddq(6) = -kv_screw_ * dq_screw_err;
 
 	// Control torques with null space damping
 	Eigen::Vector3d F_x = Lambda_x_ * ddx;
-	Eigen::VectorXd F_joint = robot->_M * ddq;
+	VectorDof F_joint = M_ * ddq;
 	command_torques_ = Jv_cap_.transpose() * F_x + Nv_cap_.transpose() * F_joint;
 
 	return RUNNING;
@@ -457,29 +919,32 @@ DemoProject::ControllerStatus DemoProject::rewindBottleCap() {
  * ----------------------------------------------------
  * Controller to move end effector to desired position.
  */
-DemoProject::ControllerStatus DemoProject::screwBottleCap() {
+template<int DOF>
+typename DemoProject<DOF>::ControllerStatus DemoProject<DOF>::screwBottleCap() {
+	requireModel(MODEL_SCREW_BOTTLE_CAP);
+
 	// Position - set xdes below the current position in z to apply a constant downward force
-	robot->position(x_des_, "link6", Eigen::Vector3d(0,0,0.16));
+	x_des_ = link6_.position(Eigen::Vector3d(0,0,0.16));
 	Eigen::Vector3d x_err = x_ - x_des_;
 	Eigen::Vector3d dx_err = dx_ - dx_des_;
 	Eigen::Vector3d ddx = -kp_pos_ * x_err - kv_pos_ * dx_err;
 
 	// Finish if the robot has converged to the last joint limit (+15deg)
-	double q_screw_err = robot->_q(6) - (KukaIIWA::JOINT_LIMITS(6) - 15.0 * M_PI / 180.0);
+	double q_screw_err = q_(6) - (KukaIIWA::JOINT_LIMITS(6) - 15.0 * M_PI / 180.0);
 	if (abs(q_screw_err) < 0.1) return FINISHED;
 
 	//Joint space velocity saturation
 	double dq_screw_des = -(kp_screw_ / kv_screw_) * q_screw_err;
 	double v = kMaxVelocity / abs(dq_screw_des);
 	if (v > 1) v = 1;
-	double dq_screw_err = robot->_dq(6) - v * dq_screw_des;
+	double dq_screw_err = dq_(6) - v * dq_screw_des;
 
-	Eigen::VectorXd ddq = -kv_joint_ * robot->_dq;
+	VectorDof ddq = -kv_joint_ * dq_;
 	ddq(6) = -kv_screw_ * dq_screw_err;
 
 	// Control torques
 	Eigen::Vector3d F_x = Lambda_x_ * ddx;
-	Eigen::VectorXd F_joint = robot->_M * ddq;
+	VectorDof F_joint = M_ * ddq;
 	command_torques_ = Jv_cap_.transpose() * F_x + Nv_cap_.transpose() * F_joint;
 
 	return RUNNING;
@@ -490,17 +955,55 @@ DemoProject::ControllerStatus DemoProject::screwBottleCap() {
  * --------------------------------
  * Initialize timer and Redis client
  */
-void DemoProject::initialize() {
+template<int DOF>
+void DemoProject<DOF>::initialize() {
 	// Create a loop timer
 	timer_.setLoopFrequency(kControlFreq);   // 1 KHz
+	timer_.setWaitBackend(LoopTimer::WAIT_CLOCK_NANOSLEEP);  // absolute wake-ups on CLOCK_MONOTONIC
+	timer_.setOverrunPolicy(LoopTimer::OVERRUN_SKIP);        // no catch-up bursts after a stall
+	timer_.setOverrunCallback([this](double overrun_seconds, unsigned long long missed_ticks) {
+		// Only counted here. Writing to the console would make the next cycle late too.
+		if (missed_ticks == 0) return;
+		++num_overruns_;
+		num_overrun_missed_ticks_ += missed_ticks;
+		if (overrun_seconds > max_overrun_seconds_) max_overrun_seconds_ = overrun_seconds;
+	});
 	// timer.setThreadHighPriority();  // make timing more accurate. requires running executable as sudo.
 	timer_.setCtrlCHandler(stop);    // exit while loop on ctrl-c
 	timer_.initializeTimer(kInitializationPause); // 1 ms pause before starting loop
+	timer_.setStatisticsCallback(kLoopStatsPeriod, [this](const LoopStatistics& stats) {
+		// Once per second, outside of the per-cycle allocation budget
+		AllocationCounter::Exempt loop_stats;
+		redis_.set(KEY_LOOP_STATS, stats.toString());
+
+		// Overruns since the last report
+		if (num_overruns_ > 0) {
+			cout << "Control loop overran " << num_overruns_ << " times (max " << 1e3 * max_overrun_seconds_
+			     << " ms). Skipped " << num_overrun_missed_ticks_ << " cycles." << endl;
+			num_overruns_ = 0;
+			num_overrun_missed_ticks_ = 0;
+			max_overrun_seconds_ = 0;
+		}
+	});
 
 	// Start redis client
 	// Make sure redis-server is running at localhost with default port 6379
 	redis_.connect(kRedisHostname, kRedisPort);
 
+	// Phase-lock the control loop to the driver if it publishes sample times.
+	// In lockstep the simulator's steps pace the loop instead.
+	if (lockstep_) {
+		cout << "Lockstep with simulator on " << KEY_SIM_STEP << "." << endl;
+	} else {
+		try {
+			stod(redis_.get(KEY_PUBLISH_TIME));
+			timer_.setPhaseLock(kPhaseLockMargin);
+			phase_lock_ = true;
+		} catch (std::exception& e) {
+			cout << "No sample times from driver on " << KEY_PUBLISH_TIME << ". Loop phase not locked." << endl;
+		}
+	}
+
 	// Set gains in Redis if not initialized
 	redis_.set(KEY_KP_POSITION, to_string(kp_pos_));
 	redis_.set(KEY_KV_POSITION, to_string(kv_pos_));
@@ -521,37 +1024,108 @@ void DemoProject::initialize() {
 	redis_.set(KEY_KP_POSITION_EXP, to_string(kp_pos_exp));
 	redis_.set(KEY_MORE_SPEED, to_string(exp_moreSpeed));
 	redis_.set(KEY_LESS_DAMPING, to_string(exp_lessDamping));
+
+	// Keys exchanged every cycle, in the order of RedisReadId and RedisWriteId
+	read_keys_ = {
+		KEY_JOINT_POSITIONS,
+		KEY_JOINT_VELOCITIES,
+		KEY_6D_SENSOR_FORCE,
+		KEY_UI_FLAG,
+		KEY_KP_POSITION,
+		KEY_KV_POSITION,
+		KEY_KP_ORIENTATION,
+		KEY_KV_ORIENTATION,
+		KEY_KP_JOINT,
+		KEY_KV_JOINT,
+		KEY_KP_JOINT_INIT,
+		KEY_KV_JOINT_INIT,
+		KEY_KP_SCREW,
+		KEY_KV_SCREW,
+		KEY_KP_SLIDING,
+		KEY_KP_BIAS,
+		KEY_MORE_SPEED,
+		KEY_LESS_DAMPING,
+		KEY_KP_ORIENTATION_EXP,
+		KEY_KV_ORIENTATION_EXP,
+		KEY_KI_ORIENTATION_EXP,
+		KEY_KP_POSITION_EXP
+	};
+	if (phase_lock_) read_keys_.push_back(KEY_PUBLISH_TIME);
+	read_values_.resize(read_keys_.size());
+	for (auto& value : read_values_) value.reserve(kRedisValueCapacity);
+
+	write_keyvals_ = {
+		{KEY_EE_POS, ""},
+		{KEY_EE_POS_DES, ""},
+		{THETA, ""},
+		{KEY_OP_POINT, ""},
+		{KEY_6D_SENSOR_FORCE_CONTROLLER, ""},
+		{KEY_COMMAND_TORQUES, ""},
+		{KEY_COMMAND_VERSION, ""}
+	};
+	if (lockstep_) write_keyvals_.emplace_back(KEY_COMMAND_STEP, "");
+	for (auto& keyval : write_keyvals_) keyval.second.reserve(kRedisValueCapacity);
+
+	sim_step_keys_ = {KEY_SIM_STEP, KEY_TIMESTAMP};
+	sim_step_values_.resize(sim_step_keys_.size());
+	for (auto& value : sim_step_values_) value.reserve(kRedisValueCapacity);
+	debug_value_.reserve(kRedisValueCapacity);
+
+	// Sensor force is read into a fixed-size vector
+	F_sensor_6d_.setZero();
 }
 
 /**
  * public DemoProject::runLoop()
  * -----------------------------
- * DemoProject state machine
+ * DemoProject state machine. Runs on the calling thread, on the newest
+ * sensor snapshot of the I/O thread, so a slow Redis round trip delays the
+ * next snapshot but never the control computation.
  */
-void DemoProject::runLoop() {
-	while (g_runloop) {
-		// Wait for next scheduled loop (controller must run at precise rate)
-		timer_.waitForNextLoop();
-		++controller_counter_;
-
-		// Get latest sensor values from Redis and update robot model
-		try {
-			readRedisValues();
-		} catch (std::exception& e) {
-			if (controller_state_ != REDIS_SYNCHRONIZATION) {
-				std::cout << e.what() << " Aborting..." << std::endl;
-				break;
-			}
-			std::cout << e.what() << " Waiting..." << std::endl;
-			std::this_thread::sleep_for(std::chrono::seconds(1));
-			continue;
-		}
+template<int DOF>
+void DemoProject<DOF>::runLoop() {
+	running_ = true;
+	std::thread io_thread(&DemoProject::ioLoop, this);
+
+	while (running()) {
+		// Count heap allocations of each cycle once warmed up
+		if (allocation_check_ && !checkAllocations()) break;
+
+		// Wait for the I/O thread to read the sensors
+		if (!waitForSnapshot()) break;
+		trace_.begin(TRACE_TRACK_CONTROL, TRACE_CYCLE);
+
+		// Take the latest sensor values and update robot model
+		perf_.begin(PERF_SNAPSHOT);
+		readSnapshot();
+		perf_.end(PERF_SNAPSHOT);
+		trace_.setCycle(TRACE_TRACK_CONTROL, command_cycle_);
+
+		perf_.begin(PERF_MODEL);
+		trace_.begin(TRACE_TRACK_CONTROL, TRACE_MODEL);
 		updateModel();
+		trace_.end(TRACE_TRACK_CONTROL, TRACE_MODEL);
+		perf_.end(PERF_MODEL);
 
+		// The span is named after the state that ran, not the next one
+		const int trace_control = TRACE_CONTROL + controller_state_;
+		perf_.begin(PERF_CONTROL);
+		trace_.begin(TRACE_TRACK_CONTROL, trace_control);
 		switch (controller_state_) {
 			// Wait until valid sensor values have been published to Redis
 			case REDIS_SYNCHRONIZATION:
-				if (isnan(robot->_q)) continue;
+				if (isnan(robot->_q)) {
+					// The simulator waits for an answer to every step
+					if (!lockstep_) {
+						trace_.end(TRACE_TRACK_CONTROL, trace_control);
+						perf_.end(PERF_CONTROL);
+						trace_.end(TRACE_TRACK_CONTROL, TRACE_CYCLE);
+						continue;
+					}
+					command_torques_.setZero();
+					break;
+				}
+				redis_synchronized_ = true;
 				cout << "Redis synchronized. Switching to joint space controller." << endl;
 				controller_state_ = JOINT_SPACE_INITIALIZATION;
 				break;
@@ -560,7 +1134,7 @@ void DemoProject::runLoop() {
 			case JOINT_SPACE_INITIALIZATION:
 				if (computeJointSpaceControlTorques() == FINISHED) {
 					cout << "INIT- Joint position initialized. Switching to align bottle cap." << endl;
-					controller_state_ = DemoProject::ALIGN_BOTTLE_CAP;
+					controller_state_ = ALIGN_BOTTLE_CAP;
 				}
 				break;
 			
@@ -569,7 +1143,7 @@ void DemoProject::runLoop() {
 				if (alignBottleCapForce() == FINISHED) {  //alignBottleCapExponentialDamping //alignBottleCap //alignBottleCapSimple
 					cout << "ALIGN- Bottle cap aligned. Switching to check alignment." << endl;
 					controller_state_ = CHECK_ALIGNMENT;
-					t_alignment_ = timer_.elapsedTime();
+					t_alignment_ = t_curr_;
 				}
 				break;
 			
@@ -613,21 +1187,91 @@ void DemoProject::runLoop() {
 			// cout << "NaN command torques. Sending zero torques to robot." << endl;
 			command_torques_.setZero();
 		}
+		trace_.end(TRACE_TRACK_CONTROL, trace_control);
+		perf_.end(PERF_CONTROL);
+
+		// Hand command torques to the I/O thread
+		perf_.begin(PERF_COMMAND);
+		publishCommand();
+		perf_.end(PERF_COMMAND);
+		trace_.end(TRACE_TRACK_CONTROL, TRACE_CYCLE);
+	}
 
-		// Send command torques
-		writeRedisValues();
+	// Stop the I/O thread. Redis is only used from this thread from here on.
+	running_ = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	cv_.notify_all();
+	io_thread.join();
+
+	// Write the spans still buffered
+	trace_.stop();
+
+	// Report allocations of the checked cycles
+	if (allocation_check_ && !allocation_check_failed_) {
+		AllocationCounter::stop();
+		unsigned long long num_checked = (allocation_check_cycles_ > allocation_check_warmup_ + 1) ?
+		                                 allocation_check_cycles_ - allocation_check_warmup_ - 1 : 0;
+		unsigned long long num_io_checked = (io_allocation_check_cycles_ > 1) ? io_allocation_check_cycles_ - 1 : 0;
+		cout << "Allocation check passed: no heap allocations in " << num_checked << " control cycles";
+		if (num_checked > 0) {
+			cout << " (" << static_cast<double>(allocation_check_exempt_) / num_checked
+			     << " exempt allocations per cycle in SAI2)";
+		}
+		cout << " and " << num_io_checked << " I/O cycles";
+		if (num_io_checked > 0) {
+			cout << " (" << static_cast<double>(io_allocation_check_exempt_) / num_io_checked
+			     << " exempt allocations per cycle in hiredis)";
+		}
+		cout << "." << endl;
 	}
 
 	// Zero out torques before quitting
 	command_torques_.setZero();
-	redis_.setEigenMatrix(KEY_COMMAND_TORQUES, command_torques_);
+	redis_.pipeset({
+		{KEY_COMMAND_TORQUES, RedisClient::encodeEigenMatrix(command_torques_)},
+		{KEY_COMMAND_VERSION, to_string(++controller_counter_)}
+	});
+
+	cout << "Loop timing : " << timer_.statistics().toString() << endl;
+	if (perf_.enabled()) cout << "Compute thread:" << endl;
+	perf_.print();
+	if (io_perf_.enabled()) cout << "I/O thread:" << endl;
+	io_perf_.print();
+}
+
+// Fixed-size controller for the Kuka
+template class DemoProject<KukaIIWA::DOF>;
+
+static int runController(shared_ptr<Model::ModelInterface> robot, const string& robot_name,
+                         const string& key_prefix, bool lockstep, bool use_perf_counters,
+                         bool check_allocations, unsigned long long allocation_warmup,
+                         const string& trace_file) {
+	DemoProject<KukaIIWA::DOF> app(move(robot), robot_name, key_prefix);
+	if (lockstep) app.enableLockstep();
+	app.initialize();
+	if (use_perf_counters) app.enablePerfCounters();
+	if (check_allocations) app.enableAllocationCheck(allocation_warmup);
+	if (!trace_file.empty()) app.enableTrace(trace_file);
+	cout << "App initialized. Waiting for Redis synchronization." << endl;
+	app.runLoop();
+	return app.allocationCheckFailed() ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
 
 	// Parse command line
-	if (argc != 4) {
-		cout << "Usage: demo_app <path-to-world.urdf> <path-to-robot.urdf> <robot-name>" << endl;
+	if (argc < 4) {
+		cout << "Usage: demo_app <path-to-world.urdf> <path-to-robot.urdf> <robot-name> [--perf] [--lockstep] [--key-prefix PREFIX] [--check-allocations [N]] [--trace FILE]" << endl
+		     << "  --perf                 Print hardware performance counters per loop section of both threads at exit." << endl
+		     << "  --lockstep             Run one control cycle per simulator step (simulator --lockstep)." << endl
+		     << "  --key-prefix PREFIX    Redis key prefix (default " << RedisServer::KEY_PREFIX << "), e.g. cs225a::world3:: for batch_simulator." << endl
+		     << "  --check-allocations [N]" << endl
+		     << "                         Exit with status 1 if a control or I/O cycle allocates on the heap after N" << endl
+		     << "                         warm-up cycles (default 1000). SAI2 and hiredis allocations are only reported." << endl
+		     << "  --trace FILE           Write the stage timings of every cycle to FILE as a Chrome trace" << endl
+		     << "                         (open in chrome://tracing or ui.perfetto.dev)." << endl;
 		exit(0);
 	}
 	// Argument 0: executable name
@@ -637,6 +1281,27 @@ int main(int argc, char** argv) {
 	string robot_file(argv[2]);
 	// Argument 3: <robot-name>
 	string robot_name(argv[3]);
+	// Optional arguments
+	bool use_perf_counters = false;
+	bool lockstep = false;
+	string key_prefix = RedisServer::KEY_PREFIX;
+	bool check_allocations = false;
+	unsigned long long allocation_warmup = 1000;
+	string trace_file;
+	for (int i = 4; i < argc; i++) {
+		if (!strcmp(argv[i], "--perf")) {
+			use_perf_counters = true;
+		} else if (!strcmp(argv[i], "--lockstep")) {
+			lockstep = true;
+		} else if (!strcmp(argv[i], "--key-prefix") && i + 1 < argc) {
+			key_prefix = argv[++i];
+		} else if (!strcmp(argv[i], "--check-allocations")) {
+			check_allocations = true;
+			if (i + 1 < argc && isdigit(argv[i+1][0])) allocation_warmup = stoull(argv[++i]);
+		} else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			trace_file = argv[++i];
+		}
+	}
 
 	// Set up signal handler
 	signal(SIGABRT, &stop);
@@ -648,14 +1313,17 @@ int main(int argc, char** argv) {
 	auto robot = make_shared<Model::ModelInterface>(robot_file, Model::rbdl, Model::urdf, false);
 	robot->updateModel();
 
+	// The task is written for the Kuka's joints
+	if (robot->dof() != KukaIIWA::DOF) {
+		cout << "Robot has " << robot->dof() << " joints. The bottle cap task needs the "
+		     << KukaIIWA::DOF << " joints of the Kuka IIWA." << endl;
+		return 1;
+	}
+
 	// Start controller app
 	cout << "Initializing app with " << robot_name << endl;
-	DemoProject app(move(robot), robot_name);
-	app.initialize();
-	cout << "App initialized. Waiting for Redis synchronization." << endl;
-	app.runLoop();
-
-	return 0;
+	return runController(move(robot), robot_name, key_prefix, lockstep, use_perf_counters,
+	                     check_allocations, allocation_warmup, trace_file);
 }
 
 // -0.628625
@@ -4,32 +4,72 @@
 // CS225a
 #include "redis/RedisClient.h"
 #include "timer/LoopTimer.h"
+#include "timer/LoopClock.h"
 #include "kuka_iiwa/KukaIIWA.h"
-#include "optoforce/Optoforce.h"
 #include "filters/ButterworthFilter.h"
+#include "perf/PerfCounters.h"
+#include "perf/AllocationCounter.h"
+#include "perf/TraceRecorder.h"
+#include "concurrency/TripleBuffer.h"
+#include "dynamics/DynamicsCache.h"
+#include "dynamics/LinkFrameCache.h"
 
 // Standard
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 // External
 #include <Eigen/Core>
 #include <hiredis/hiredis.h>
 #include <model/ModelInterface.h>
 
+/**
+ * Bottle cap controller for the Kuka IIWA, templated on the robot's degrees
+ * of freedom.
+ *
+ * DemoProject<KukaIIWA::DOF> keeps every joint-space quantity in fixed-size
+ * Eigen types (Matrix<double, 7, 7>, Matrix<double, 6, 7>, ...), so the
+ * control kernels are unrolled and vectorized without heap temporaries.
+ * The home pose and the screwing motion of the last joint are specific to
+ * the Kuka, so only DemoProject<KukaIIWA::DOF> is instantiated.
+ */
+template<int DOF>
 class DemoProject {
 
 public:
 
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	typedef Eigen::Matrix<double, DOF, 1> VectorDof;
+	typedef Eigen::Matrix<double, DOF, DOF> MatrixDof;
+	typedef Eigen::Matrix<double, 6, DOF> Matrix6Dof;
+	typedef Eigen::Matrix<double, 3, DOF> Matrix3Dof;
+	typedef Eigen::Matrix<double, 6, 1> Vector6d;
+	typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
 	DemoProject(std::shared_ptr<Model::ModelInterface> robot,
-		        const std::string &robot_name) :
+		        const std::string &robot_name,
+		        const std::string &redis_key_prefix = RedisServer::KEY_PREFIX) :
 		robot(robot),
 		dof(robot->dof()),
+		kRedisKeyPrefix(redis_key_prefix),
 		KEY_COMMAND_TORQUES (kRedisKeyPrefix + robot_name + "::actuators::fgc"),
 		KEY_EE_POS          (kRedisKeyPrefix + robot_name + "::tasks::ee_pos"),
 		KEY_EE_POS_DES      (kRedisKeyPrefix + robot_name + "::tasks::ee_pos_des"),
+		KEY_LOOP_STATS      (kRedisKeyPrefix + robot_name + "::timer::stats"),
+		KEY_COMMAND_STEP    (kRedisKeyPrefix + robot_name + "::actuators::step"),
+		KEY_COMMAND_VERSION (kRedisKeyPrefix + robot_name + "::actuators::fgc_version"),
 		KEY_JOINT_POSITIONS (kRedisKeyPrefix + robot_name + "::sensors::q"),
 		KEY_JOINT_VELOCITIES(kRedisKeyPrefix + robot_name + "::sensors::dq"),
+		KEY_PUBLISH_TIME    (kRedisKeyPrefix + robot_name + "::sensors::t_publish"),
+		KEY_SIM_STEP        (kRedisKeyPrefix + robot_name + "::sim::step"),
+		KEY_6D_SENSOR_FORCE (kRedisKeyPrefix + "optoforce_6d::force"),
 	    THETA(kRedisKeyPrefix + robot_name + "::sensor::theta"),
 		KEY_TIMESTAMP       (kRedisKeyPrefix + robot_name + "::timestamp"),
 		KEY_KP_POSITION     (kRedisKeyPrefix + robot_name + "::tasks::kp_pos"),
@@ -51,6 +91,14 @@ public:
 	    KEY_KP_POSITION_EXP (kRedisKeyPrefix + robot_name + "::tasks::kp_pos_exp"),
 	    KEY_MORE_SPEED(kRedisKeyPrefix + robot_name + "::tasks::more_speed"),
 	    KEY_LESS_DAMPING(kRedisKeyPrefix + robot_name + "::tasks::less_damping"),
+		KEY_OP_POINT        (kRedisKeyPrefix + robot_name + "::tasks::op_point"),
+		KEY_6D_SENSOR_FORCE_CONTROLLER(kRedisKeyPrefix + robot_name + "::optoforce_6d::force_controller"),
+		KEY_LAMBDA_X_CAP    (kRedisKeyPrefix + robot_name + "::tasks::lambda_x_cap"),
+		KEY_INTEGRAL_DPHI   (kRedisKeyPrefix + robot_name + "::tasks::integral_dPhi"),
+		KEY_DPHI            (kRedisKeyPrefix + robot_name + "::tasks::dPhi"),
+		debug_keys_{{KEY_INTEGRAL_DPHI, KEY_DPHI, KEY_LAMBDA_X_CAP}},
+		snapshot_buffer_(SensorSnapshot(dof)),
+		command_buffer_(ControlCommand(dof)),
 
 		command_torques_(dof),
 		J_cap_(6, dof),
@@ -67,6 +115,11 @@ public:
 		Lambda_x_cap_(3, 3),
 		Lambda_r_cap_(3, 3),
 		g_(dof),
+		M_(dof, dof),
+		dynamics_(dof),
+		link6_(dof),
+		q_(dof),
+		dq_(dof),
 		q_des_(dof),
 		dq_des_(dof),
 		controller_state_(REDIS_SYNCHRONIZATION)
@@ -90,13 +143,62 @@ public:
 		// Initialize pivot point filter
 		op_point_filter_.setDimension(3);
 		op_point_filter_.setCutoffFrequency(0.2);
+
+		// Loop sections for hardware performance counters (order of PerfSectionId
+		// and IoPerfSectionId)
+		perf_.addSection("snapshot");
+		perf_.addSection("model");
+		perf_.addSection("control");
+		perf_.addSection("command");
+		io_perf_.addSection("read");
+		io_perf_.addSection("write");
+
+		// Trace stages (order of TraceStageId, then one per ControllerState)
+		trace_.addTrack("control");
+		trace_.addTrack("io");
+		trace_.addStage("cycle");
+		trace_.addStage("read");
+		trace_.addStage("model");
+		trace_.addStage("write");
+		trace_.addStage("redis_synchronization");
+		trace_.addStage("joint_space_initialization");
+		trace_.addStage("align_bottle_cap");
+		trace_.addStage("check_alignment");
+		trace_.addStage("rewind_bottle_cap");
+		trace_.addStage("screw_bottle_cap");
 	}
 
 	/***** Public functions *****/
 
 	void initialize();
+
+	// Run the controller until stopped. Redis reads and writes run on a
+	// separate I/O thread. The calling thread computes the commands.
 	void runLoop();
 
+	// Count cycles, instructions, cache and branch misses per loop section
+	// of the compute and I/O threads. Call from the thread that calls runLoop().
+	void enablePerfCounters() { perf_.enable(); io_perf_enabled_ = true; }
+
+	// Run in lockstep with the simulator: wait for each published step
+	// instead of the timer and acknowledge it with the command torques.
+	// Call before initialize().
+	void enableLockstep();
+
+	// Stop the loop if a control cycle allocates on the heap after the
+	// controller has run warmup_cycles cycles past Redis synchronization.
+	// Allocations inside SAI2 and hiredis are exempt and only reported.
+	// Call from the thread that calls runLoop().
+	void enableAllocationCheck(unsigned long long warmup_cycles);
+
+	// Whether the allocation check stopped the loop
+	bool allocationCheckFailed() const { return allocation_check_failed_; }
+
+	// Record the stages of every cycle to filename as a Chrome trace, for
+	// chrome://tracing or ui.perfetto.dev. The trace is closed when
+	// runLoop() returns.
+	bool enableTrace(const std::string& filename) { return trace_.start(filename); }
+
 protected:
 
 	/***** Enums *****/
@@ -111,6 +213,112 @@ protected:
 		SCREW_BOTTLE_CAP
 	};
 
+	// Model quantities computed on demand by requireModel(). The link6 frame,
+	// the end effector kinematics (x_, dx_, w_, R_ee_to_base_) and M_ are
+	// always updated.
+	enum ModelQuantity {
+		MODEL_J_CAP        = 1 << 0,   // J_cap_
+		MODEL_JV           = 1 << 1,   // Jv_
+		MODEL_JW           = 1 << 2,   // Jw_
+		MODEL_JV_CAP       = 1 << 3,   // Jv_cap_
+		MODEL_JW_CAP       = 1 << 4,   // Jw_cap_ = Jw_ Nv_cap_
+		MODEL_N_CAP        = 1 << 5,   // N_cap_
+		MODEL_NV           = 1 << 6,   // Nv_
+		MODEL_NV_CAP       = 1 << 7,   // Nv_cap_
+		MODEL_NVW_CAP      = 1 << 8,   // Nvw_cap_
+		MODEL_LAMBDA_CAP   = 1 << 9,   // Lambda_cap_
+		MODEL_LAMBDA_X     = 1 << 10,  // Lambda_x_
+		MODEL_LAMBDA_X_CAP = 1 << 11,  // Lambda_x_cap_
+		MODEL_LAMBDA_R_CAP = 1 << 12,  // Lambda_r_cap_
+		MODEL_GRAVITY      = 1 << 13,  // g_
+
+		// Quantities used by each controller
+		MODEL_JOINT_SPACE = 0,
+		MODEL_ALIGN_BOTTLE_CAP = MODEL_J_CAP | MODEL_N_CAP | MODEL_LAMBDA_CAP,
+		MODEL_ALIGN_BOTTLE_CAP_FORCE = MODEL_JV_CAP | MODEL_JW_CAP | MODEL_NVW_CAP | MODEL_LAMBDA_X_CAP | MODEL_LAMBDA_R_CAP,
+		MODEL_SCREW_BOTTLE_CAP = MODEL_JV_CAP | MODEL_NV_CAP | MODEL_LAMBDA_X
+	};
+
+	// Compute thread sections measured by perf_. Snapshot and command only
+	// exchange buffers with the I/O thread.
+	enum PerfSectionId {
+		PERF_SNAPSHOT,
+		PERF_MODEL,
+		PERF_CONTROL,
+		PERF_COMMAND
+	};
+
+	// I/O thread sections measured by io_perf_: the Redis round trips with
+	// decoding and encoding
+	enum IoPerfSectionId {
+		IO_PERF_READ,
+		IO_PERF_WRITE
+	};
+
+	// Threads recorded by trace_ (order of addTrack())
+	enum TraceTrackId {
+		TRACE_TRACK_CONTROL,
+		TRACE_TRACK_IO
+	};
+
+	// Cycle stages recorded by trace_ (order of addStage()). Read and write
+	// are recorded by the I/O thread, the others by the compute thread. The
+	// control stage of each cycle is TRACE_CONTROL + controller_state_.
+	enum TraceStageId {
+		TRACE_CYCLE,
+		TRACE_READ,
+		TRACE_MODEL,
+		TRACE_WRITE,
+		TRACE_CONTROL
+	};
+
+	// Values read from Redis every cycle (order of read_keys_)
+	enum RedisReadId {
+		READ_JOINT_POSITIONS,
+		READ_JOINT_VELOCITIES,
+		READ_6D_SENSOR_FORCE,
+		READ_UI_FLAG,
+		READ_KP_POSITION,
+		READ_KV_POSITION,
+		READ_KP_ORIENTATION,
+		READ_KV_ORIENTATION,
+		READ_KP_JOINT,
+		READ_KV_JOINT,
+		READ_KP_JOINT_INIT,
+		READ_KV_JOINT_INIT,
+		READ_KP_SCREW,
+		READ_KV_SCREW,
+		READ_KP_SLIDING,
+		READ_KP_BIAS,
+		READ_MORE_SPEED,
+		READ_LESS_DAMPING,
+		READ_KP_ORIENTATION_EXP,
+		READ_KV_ORIENTATION_EXP,
+		READ_KI_ORIENTATION_EXP,
+		READ_KP_POSITION_EXP,
+		READ_PUBLISH_TIME  // Only with phase lock
+	};
+
+	// Values written to Redis every cycle (order of write_keyvals_)
+	enum RedisWriteId {
+		WRITE_EE_POS,
+		WRITE_EE_POS_DES,
+		WRITE_THETA,
+		WRITE_OP_POINT,
+		WRITE_6D_SENSOR_FORCE_CONTROLLER,
+		WRITE_COMMAND_TORQUES,
+		WRITE_COMMAND_VERSION,
+		WRITE_COMMAND_STEP  // Only in lockstep
+	};
+
+	// Intermediate controller values sent to Redis for plotting
+	enum DebugValueId {
+		DEBUG_INTEGRAL_DPHI,
+		DEBUG_DPHI,
+		DEBUG_LAMBDA_X_CAP,
+		NUM_DEBUG_VALUES
+	};
+
 	// Return values from computeControlTorques() methods
 	enum ControllerStatus {
 		RUNNING,  // Not yet converged to goal position
@@ -118,6 +326,48 @@ protected:
 		FAILED
 	};
 
+	/***** Thread exchange *****/
+
+	typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, 3, 3> DebugValue;
+
+	// Values read from Redis in one I/O cycle
+	struct SensorSnapshot {
+		explicit SensorSnapshot(int dof) : q(dof), dq(dof) {
+			q.setZero();
+			dq.setZero();
+			F_sensor_6d.setZero();
+			values.fill(0);
+		}
+
+		uint64_t cycle = 0;       // I/O cycle of the read
+		long long sim_step = -1;  // Simulator step in lockstep
+		double t = 0;             // Loop time of the read
+		VectorDof q, dq;
+		Vector6d F_sensor_6d;
+		std::array<double, READ_PUBLISH_TIME> values;  // Scalar values by RedisReadId
+	};
+
+	// Values written to Redis in one I/O cycle
+	struct ControlCommand {
+		explicit ControlCommand(int dof) : command_torques(dof) {
+			command_torques.setZero();
+			x.setZero();
+			x_des.setZero();
+			op_point.setZero();
+			F_sensor_6d.setZero();
+			for (auto& value : debug) value.setZero(3, 3);
+		}
+
+		uint64_t cycle = 0;       // Snapshot cycle the command answers
+		long long sim_step = -1;  // Simulator step the command answers
+		VectorDof command_torques;
+		Eigen::Vector3d x, x_des, op_point;
+		double theta = 0;
+		Vector6d F_sensor_6d;
+		std::array<DebugValue, NUM_DEBUG_VALUES> debug;
+		unsigned int debug_mask = 0;  // Debug values set this cycle (DebugValueId bits)
+	};
+
 	/***** Constants *****/
 
 	const int dof;  // Initialized with robot model
@@ -127,21 +377,33 @@ protected:
 
 	const int kControlFreq = 1000;         // 1 kHz control loop
 	const int kInitializationPause = 1e6;  // 1ms pause before starting control loop
+	const double kLoopStatsPeriod = 1.0;   // Publish loop timing statistics every second
+	const double kPhaseLockMargin = 1e-4;  // Wake up 0.1ms after the driver publishes a sample
+	const double kSimStepPollPeriod = 20e-6;  // Lockstep: pause between polls for the next simulator step
 
 	const int kIntegraldPhiWindow = 2000;
 
+	const size_t kRedisValueCapacity = 1024;  // Reserved length of Redis values read and written every cycle
+	const double kCommandTimeout = 0.9 / kControlFreq;  // Longest wait of the I/O thread for the command of its cycle, except in lockstep
+
 	const std::string kRedisHostname = "127.0.0.1";
 	const int kRedisPort = 6379;
 
 	// Redis keys:
-	const std::string kRedisKeyPrefix = RedisServer::KEY_PREFIX;
+	const std::string kRedisKeyPrefix;
 	// - write:
 	const std::string KEY_COMMAND_TORQUES;
 	const std::string KEY_EE_POS;
 	const std::string KEY_EE_POS_DES;
+	const std::string KEY_LOOP_STATS;
+	const std::string KEY_COMMAND_STEP;
+	const std::string KEY_COMMAND_VERSION;
 	// - read:
 	const std::string KEY_JOINT_POSITIONS;
 	const std::string KEY_JOINT_VELOCITIES;
+	const std::string KEY_PUBLISH_TIME;
+	const std::string KEY_SIM_STEP;
+	const std::string KEY_6D_SENSOR_FORCE;  // Optoforce::KEY_6D_SENSOR_FORCE with the default prefix
 	const std::string KEY_TIMESTAMP;
 	const std::string KEY_KP_POSITION;
 	const std::string KEY_KV_POSITION;
@@ -163,12 +425,30 @@ protected:
 	const std::string KEY_MORE_SPEED;
 	const std::string KEY_LESS_DAMPING;
 	const std::string THETA;
+	// - debug:
+	const std::string KEY_OP_POINT;
+	const std::string KEY_6D_SENSOR_FORCE_CONTROLLER;
+	const std::string KEY_LAMBDA_X_CAP;
+	const std::string KEY_INTEGRAL_DPHI;
+	const std::string KEY_DPHI;
 
 	/***** Member functions *****/
 
+	bool running() const;
+	void ioLoop();
+	bool waitForSimulationStep();
 	void readRedisValues();
-	void updateModel();
 	void writeRedisValues();
+	bool waitForSnapshot();
+	bool waitForCommand(uint64_t cycle);
+	void readSnapshot();
+	void publishCommand();
+	void updateModel();
+	void requireModel(unsigned int quantities);
+	static unsigned int modelQuantities(ControllerState state);
+	void setDebugValue(DebugValueId id, const Eigen::Ref<const Eigen::MatrixXd>& value);
+	bool checkAllocations();
+	bool checkIoAllocations();
 	ControllerStatus computeJointSpaceControlTorques();
 	ControllerStatus computeOperationalSpaceControlTorques();
 	ControllerStatus alignBottleCap();
@@ -185,27 +465,88 @@ protected:
 	// Robot
 	const std::shared_ptr<Model::ModelInterface> robot;
 
-	// Redis
+	// Redis, used by the I/O thread only while the loop runs
 	RedisClient redis_;
 
-	// Timer
+	// Keys and values exchanged every cycle, built once in initialize() so
+	// the loop reuses their storage
+	std::vector<std::string> read_keys_, read_values_;
+	std::vector<std::pair<std::string, std::string>> write_keyvals_;
+	std::vector<std::string> sim_step_keys_, sim_step_values_;
+	std::string debug_value_;
+	std::array<std::string, NUM_DEBUG_VALUES> debug_keys_;
+
+	// I/O and compute threads. The sensor snapshot and the command are
+	// exchanged without locks. The mutex only guards waiting on cv_.
+	TripleBuffer<SensorSnapshot> snapshot_buffer_;  // I/O thread to compute thread
+	TripleBuffer<ControlCommand> command_buffer_;   // Compute thread to I/O thread
+	std::atomic<bool> running_{false};
+	std::atomic<bool> redis_synchronized_{false};  // Valid sensor values received
+	std::mutex mutex_;
+	std::condition_variable cv_;
+
+	// Timer, paced by the I/O thread
 	LoopTimer timer_;
-	double t_curr_;
-	uint64_t controller_counter_ = 0;
+	double t_curr_;  // Loop time of the current snapshot, simulation time in lockstep
+	uint64_t controller_counter_ = 0;  // I/O cycles
+	uint64_t command_cycle_ = 0;  // Cycle of the current snapshot
+	uint64_t command_written_ = 0;  // Cycle of the last command written to Redis
+	bool phase_lock_ = false;  // Driver publishes KEY_PUBLISH_TIME
+
+	// Overruns since the last loop statistics report
+	unsigned long long num_overruns_ = 0;
+	unsigned long long num_overrun_missed_ticks_ = 0;
+	double max_overrun_seconds_ = 0;
+
+	// Lockstep simulation
+	bool lockstep_ = false;
+	long long sim_step_ = -1;  // Last step received from the simulator
+	long long sim_step_acknowledged_ = -1;
+	long long command_sim_step_ = -1;  // Step of the current snapshot
+	std::shared_ptr<SimulationClock> sim_clock_;
 
 	// State machine
 	ControllerState controller_state_;
 
+	// Hardware performance counters, one per thread
+	PerfCounters perf_;
+	PerfCounters io_perf_;
+	bool io_perf_enabled_ = false;  // Open io_perf_ on the I/O thread
+
+	// Per-cycle stage timings
+	TraceRecorder trace_;
+
+	// Allocation check. Each thread counts its own allocations. The I/O
+	// thread starts once the compute thread is warmed up.
+	bool allocation_check_ = false;
+	std::atomic<bool> allocation_check_failed_{false};
+	std::atomic<bool> allocation_check_started_{false};
+	unsigned long long allocation_check_warmup_ = 0;
+	unsigned long long allocation_check_cycles_ = 0;  // Cycles since Redis synchronization
+	uint64_t allocation_check_exempt_ = 0;  // Exempt allocations in checked cycles
+	unsigned long long io_allocation_check_cycles_ = 0;  // I/O cycles since the check started
+	uint64_t io_allocation_check_exempt_ = 0;
+
+	// Model quantities computed this cycle (ModelQuantity bits)
+	unsigned int model_valid_ = 0;
+
 	// Controller variables
-	Eigen::VectorXd command_torques_;
-	Eigen::MatrixXd J_cap_, Jv_, Jw_, Jv_cap_, Jw_cap_;
-	Eigen::MatrixXd N_cap_, Nv_, Nv_cap_, Nvw_cap_;
-	Eigen::MatrixXd Lambda_cap_, Lambda_x_, Lambda_x_cap_, Lambda_r_cap_;
-	Eigen::VectorXd g_;
+	VectorDof command_torques_;
+	Matrix6Dof J_cap_;
+	Matrix3Dof Jv_, Jw_, Jv_cap_, Jw_cap_;
+	MatrixDof N_cap_, Nv_, Nv_cap_, Nvw_cap_;
+	Matrix6d Lambda_cap_;
+	Eigen::Matrix3d Lambda_x_, Lambda_x_cap_, Lambda_r_cap_;
+	VectorDof g_;
+	MatrixDof M_;  // Copy of robot->_M
+	DynamicsCache<DOF> dynamics_;  // Task inertias and nullspaces from one factorization of M_
+	LinkFrameCache<DOF> link6_;    // Kinematics of points on link6 from one query of the model
+	VectorDof q_, dq_;  // Copies of robot->_q and robot->_dq
 	Eigen::Vector3d x_, dx_, w_;
-	Eigen::VectorXd q_des_, dq_des_;
+	VectorDof q_des_, dq_des_;
 	Eigen::Vector3d x_des_, dx_des_;
 	Eigen::Vector3d F_sensor_, M_sensor_;
+	Vector6d F_sensor_6d_;
 	Eigen::Matrix3d R_ee_to_base_;
 	Eigen::Matrix3d R_sensor_to_ee_;
 	std::vector<Eigen::Vector3d> vec_dPhi_ = std::vector<Eigen::Vector3d>(kIntegraldPhiWindow);
@@ -216,6 +557,10 @@ protected:
 	ButterworthFilter op_point_filter_;
 	Eigen::Vector3d op_point_;
 
+	// SAI2 computes into Eigen::MatrixXd. The result is copied into g_
+	// through this, which keeps its allocation.
+	Eigen::VectorXd model_g_;
+
 	// Default gains (used only when keys are nonexistent in Redis)
 	double kp_pos_ = 30;
 	//double kp_pos_ = 40;
@@ -242,6 +587,9 @@ protected:
 
 	// angle between contact surface normal and cap normal
 	double theta;
+
+	// UI flag to finish joint space initialization
+	int ui_flag_ = 0;
 };
 
 #endif  // DEMO_PROJECT_H
@@ -0,0 +1,192 @@
+/**
+ * DynamicsCache.h
+ *
+ * Operational space dynamics from one factorization of the mass matrix.
+ */
+
+#ifndef SAI_DYNAMICS_CACHE_H
+#define SAI_DYNAMICS_CACHE_H
+
+#include <algorithm>
+#include <limits>
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/Eigenvalues>
+
+/**
+ * Task inertias, dynamically consistent inverses and nullspaces of any
+ * number of task Jacobians, derived from a single LDLT factorization of
+ * the joint space mass matrix per cycle.
+ *
+ *   DynamicsCache<7> dynamics;
+ *   while (running) {
+ *     robot->updateModel();
+ *     dynamics.update(robot->_M);
+ *     dynamics.taskMatrices(Lambda, N, J);
+ *     dynamics.taskMatrices(Lambda_2, N_2, J_2, N);
+ *   }
+ *
+ * M is factored and inverted on first use after update(), and M^-1 is
+ * shared by every task until the next update(). Task inertias are
+ * pseudo-inverses of J M^-1 J^T, like
+ * Model::ModelInterface::taskInertiaMatrixWithPseudoInv(), so singular
+ * tasks stay bounded. With DOF fixed at compile time nothing allocates.
+ */
+template<int DOF>
+class DynamicsCache {
+
+public:
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	typedef Eigen::Matrix<double, DOF, DOF> MatrixDof;
+
+	/**
+	 * @param dof  Degrees of freedom. Only used if DOF is Eigen::Dynamic.
+	 */
+	explicit DynamicsCache(int dof = DOF) :
+		dof_(DOF == Eigen::Dynamic ? dof : DOF),
+		M_(dof_, dof_),
+		M_inv_(dof_, dof_),
+		ldlt_(dof_)
+	{
+		M_.setIdentity();
+		M_inv_.setIdentity();
+	}
+
+	/**
+	 * Set the mass matrix of this cycle. Invalidates the factorization.
+	 */
+	template<typename Derived>
+	void update(const Eigen::MatrixBase<Derived>& M) {
+		M_ = M;
+		factorized_ = false;
+		inverted_ = false;
+	}
+
+	/**
+	 * LDLT factorization of the mass matrix, e.g. to solve M x = b.
+	 */
+	const Eigen::LDLT<MatrixDof>& massMatrixFactorization() {
+		if (!factorized_) {
+			ldlt_.compute(M_);
+			factorized_ = true;
+		}
+		return ldlt_;
+	}
+
+	/**
+	 * Inverse of the mass matrix.
+	 */
+	const MatrixDof& massMatrixInverse() {
+		if (!inverted_) {
+			M_inv_.setIdentity();
+			massMatrixFactorization().solveInPlace(M_inv_);
+			inverted_ = true;
+		}
+		return M_inv_;
+	}
+
+	/**
+	 * Lambda = (J M^-1 J^T)^+
+	 */
+	template<typename DerivedLambda, typename DerivedJ>
+	void taskInertiaMatrix(Eigen::MatrixBase<DerivedLambda>& Lambda, const Eigen::MatrixBase<DerivedJ>& J) {
+		typedef Eigen::Matrix<double, DerivedJ::RowsAtCompileTime, DerivedJ::RowsAtCompileTime> MatrixTask;
+		MatrixTask Lambda_inv;
+		Lambda_inv.noalias() = J * massMatrixInverse() * J.transpose();
+		pseudoInverse(Lambda, Lambda_inv);
+	}
+
+	/**
+	 * Jbar = M^-1 J^T Lambda, with Lambda from taskInertiaMatrix().
+	 */
+	template<typename DerivedJbar, typename DerivedJ, typename DerivedLambda>
+	void dynConsistentInverseJacobian(Eigen::MatrixBase<DerivedJbar>& Jbar, const Eigen::MatrixBase<DerivedJ>& J,
+	                                  const Eigen::MatrixBase<DerivedLambda>& Lambda) {
+		Jbar.noalias() = massMatrixInverse() * J.transpose() * Lambda;
+	}
+
+	/**
+	 * N = I - Jbar J
+	 */
+	template<typename DerivedN, typename DerivedJ>
+	void nullspaceMatrix(Eigen::MatrixBase<DerivedN>& N, const Eigen::MatrixBase<DerivedJ>& J) {
+		typedef Eigen::Matrix<double, DerivedJ::RowsAtCompileTime, DerivedJ::RowsAtCompileTime> MatrixTask;
+		MatrixTask Lambda(J.rows(), J.rows());
+		taskMatrices(Lambda, N, J);
+	}
+
+	/**
+	 * N = (I - Jbar J) N_prec, for a task in the nullspace N_prec of another.
+	 */
+	template<typename DerivedN, typename DerivedJ, typename DerivedNprec>
+	void nullspaceMatrix(Eigen::MatrixBase<DerivedN>& N, const Eigen::MatrixBase<DerivedJ>& J,
+	                     const Eigen::MatrixBase<DerivedNprec>& N_prec) {
+		typedef Eigen::Matrix<double, DerivedJ::RowsAtCompileTime, DerivedJ::RowsAtCompileTime> MatrixTask;
+		MatrixTask Lambda(J.rows(), J.rows());
+		taskMatrices(Lambda, N, J, N_prec);
+	}
+
+	/**
+	 * Task inertia and nullspace of one task, sharing J M^-1.
+	 */
+	template<typename DerivedLambda, typename DerivedN, typename DerivedJ>
+	void taskMatrices(Eigen::MatrixBase<DerivedLambda>& Lambda, Eigen::MatrixBase<DerivedN>& N,
+	                  const Eigen::MatrixBase<DerivedJ>& J) {
+		typedef Eigen::Matrix<double, DerivedJ::RowsAtCompileTime, DerivedJ::RowsAtCompileTime> MatrixTask;
+		typedef Eigen::Matrix<double, DerivedJ::RowsAtCompileTime, DOF> MatrixTaskDof;
+		typedef Eigen::Matrix<double, DOF, DerivedJ::RowsAtCompileTime> MatrixDofTask;
+
+		// M^-1 is symmetric: (J M^-1)^T = M^-1 J^T
+		MatrixTaskDof J_M_inv(J.rows(), dof_);
+		J_M_inv.noalias() = J * massMatrixInverse();
+		MatrixTask Lambda_inv(J.rows(), J.rows());
+		Lambda_inv.noalias() = J_M_inv * J.transpose();
+		pseudoInverse(Lambda, Lambda_inv);
+
+		MatrixDofTask Jbar(dof_, J.rows());
+		Jbar.noalias() = J_M_inv.transpose() * Lambda;
+		N.derived().setIdentity(dof_, dof_);
+		N.noalias() -= Jbar * J;
+	}
+
+	template<typename DerivedLambda, typename DerivedN, typename DerivedJ, typename DerivedNprec>
+	void taskMatrices(Eigen::MatrixBase<DerivedLambda>& Lambda, Eigen::MatrixBase<DerivedN>& N,
+	                  const Eigen::MatrixBase<DerivedJ>& J, const Eigen::MatrixBase<DerivedNprec>& N_prec) {
+		MatrixDof N_task(dof_, dof_);
+		taskMatrices(Lambda, N_task, J);
+		N.noalias() = N_task * N_prec;
+	}
+
+	/**
+	 * Pseudo-inverse of a symmetric positive semi-definite matrix.
+	 * Eigenvalues below eps * size * the largest one are dropped, the
+	 * tolerance SAI2 uses.
+	 */
+	template<typename DerivedInv, typename Derived>
+	static void pseudoInverse(Eigen::MatrixBase<DerivedInv>& A_inv, const Eigen::MatrixBase<Derived>& A) {
+		typedef Eigen::Matrix<double, Derived::RowsAtCompileTime, Derived::ColsAtCompileTime> MatrixA;
+		Eigen::SelfAdjointEigenSolver<MatrixA> eig(A);
+		const auto& lambda = eig.eigenvalues();
+		double tolerance = std::numeric_limits<double>::epsilon() * A.rows() * lambda.cwiseAbs().maxCoeff();
+		typename Eigen::SelfAdjointEigenSolver<MatrixA>::RealVectorType lambda_inv =
+			(lambda.array().abs() > tolerance).select(lambda.array().inverse(), 0.0).matrix();
+		A_inv.noalias() = eig.eigenvectors() * lambda_inv.asDiagonal() * eig.eigenvectors().transpose();
+	}
+
+	int dof() const { return dof_; }
+
+protected:
+
+	const int dof_;
+	MatrixDof M_;
+	MatrixDof M_inv_;
+	Eigen::LDLT<MatrixDof> ldlt_;
+	bool factorized_ = false;
+	bool inverted_ = false;
+
+};
+
+#endif  // SAI_DYNAMICS_CACHE_H
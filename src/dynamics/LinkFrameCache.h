@@ -0,0 +1,147 @@
+/**
+ * LinkFrameCache.h
+ *
+ * Kinematics of points on one link from a single model query per cycle.
+ */
+
+#ifndef SAI_LINK_FRAME_CACHE_H
+#define SAI_LINK_FRAME_CACHE_H
+
+#include <string>
+
+#include <Eigen/Core>
+#include <model/ModelInterface.h>
+
+/**
+ * Position, velocity and Jacobians of any point on a link, derived from the
+ * link frame.
+ *
+ * update() queries the model once for the link origin, its rotation and its
+ * 6xN Jacobian J_0 = [Jv; Jw] (the SAI2 ordering). The link velocities follow
+ * from J_0 dq. Quantities of a point p in link coordinates are derived as
+ *
+ *   x(p)  = x_0 + R p
+ *   v(p)  = v_0 + w x (R p)
+ *   Jv(p) = Jv_0 - [R p]x Jw
+ *
+ * instead of walking the kinematic tree again for every point and query.
+ *
+ *   LinkFrameCache<7> link6;
+ *   robot->updateModel();
+ *   link6.update(*robot, "link6", robot->_dq);
+ *   link6.J_0(J_ee, Eigen::Vector3d(0,0,0.11));
+ */
+template<int DOF>
+class LinkFrameCache {
+
+public:
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	typedef Eigen::Matrix<double, 6, DOF> Matrix6Dof;
+
+	/**
+	 * @param dof  Degrees of freedom. Only used if DOF is Eigen::Dynamic.
+	 */
+	explicit LinkFrameCache(int dof = DOF) :
+		J_0_(6, DOF == Eigen::Dynamic ? dof : DOF)
+	{
+		x_.setZero();
+		R_.setIdentity();
+		v_.setZero();
+		w_.setZero();
+		J_0_.setZero();
+	}
+
+	/**
+	 * Query the link frame. Call once per cycle after robot.updateModel().
+	 *
+	 * @param robot      Updated robot model.
+	 * @param link_name  Link of the frame.
+	 * @param dq         Joint velocities of the model update.
+	 */
+	template<typename Derived>
+	void update(Model::ModelInterface& robot, const std::string& link_name, const Eigen::MatrixBase<Derived>& dq) {
+		robot.position(x_, link_name, Eigen::Vector3d::Zero());
+		robot.rotation(R_, link_name);
+		robot.J_0(model_J_, link_name, Eigen::Vector3d::Zero());
+		J_0_ = model_J_;
+		v_.noalias() = J_0_.template topRows<3>() * dq;
+		w_.noalias() = J_0_.template bottomRows<3>() * dq;
+	}
+
+	/**
+	 * Position of point p (link coordinates) in base coordinates.
+	 */
+	Eigen::Vector3d position(const Eigen::Vector3d& p = Eigen::Vector3d::Zero()) const {
+		return x_ + R_ * p;
+	}
+
+	/**
+	 * Rotation from link to base coordinates.
+	 */
+	const Eigen::Matrix3d& rotation() const { return R_; }
+
+	/**
+	 * Linear velocity of point p (link coordinates) in base coordinates.
+	 */
+	Eigen::Vector3d linearVelocity(const Eigen::Vector3d& p = Eigen::Vector3d::Zero()) const {
+		return v_ + w_.cross(R_ * p);
+	}
+
+	/**
+	 * Angular velocity of the link in base coordinates.
+	 */
+	const Eigen::Vector3d& angularVelocity() const { return w_; }
+
+	/**
+	 * Jacobian [Jv; Jw] of point p (link coordinates).
+	 */
+	template<typename Derived>
+	void J_0(Eigen::MatrixBase<Derived>& J, const Eigen::Vector3d& p = Eigen::Vector3d::Zero()) const {
+		J = J_0_;
+		J.template topRows<3>().noalias() -= skew(R_ * p) * J_0_.template bottomRows<3>();
+	}
+
+	/**
+	 * Linear velocity Jacobian of point p (link coordinates).
+	 */
+	template<typename Derived>
+	void Jv(Eigen::MatrixBase<Derived>& J, const Eigen::Vector3d& p = Eigen::Vector3d::Zero()) const {
+		J = J_0_.template topRows<3>();
+		J.noalias() -= skew(R_ * p) * J_0_.template bottomRows<3>();
+	}
+
+	/**
+	 * Angular velocity Jacobian of the link.
+	 */
+	template<typename Derived>
+	void Jw(Eigen::MatrixBase<Derived>& J) const {
+		J = J_0_.template bottomRows<3>();
+	}
+
+	/**
+	 * Cross product matrix: skew(r) * a = r x a.
+	 */
+	static Eigen::Matrix3d skew(const Eigen::Vector3d& r) {
+		Eigen::Matrix3d S;
+		S <<      0, -r(2),  r(1),
+		       r(2),     0, -r(0),
+		      -r(1),  r(0),     0;
+		return S;
+	}
+
+protected:
+
+	Eigen::Vector3d x_;  // Link origin
+	Eigen::Matrix3d R_;  // Link to base rotation
+	Eigen::Vector3d v_;  // Linear velocity of the link origin
+	Eigen::Vector3d w_;  // Angular velocity
+	Matrix6Dof J_0_;     // [Jv; Jw] of the link origin
+
+	// SAI2 computes into Eigen::MatrixXd, which keeps its allocation
+	Eigen::MatrixXd model_J_;
+
+};
+
+#endif  // SAI_LINK_FRAME_CACHE_H
@@ -27,6 +27,7 @@ const char TOOL_FILENAME[]  = "resources/kuka_iiwa_driver/tool.xml";
 const std::string KEY_PREFIX = RedisServer::KEY_PREFIX + "kuka_iiwa::";
 // Redis keys sent to robot
 const std::string KEY_COMMAND_TORQUES         = KEY_PREFIX + "actuators::fgc";
+const std::string KEY_COMMAND_VERSION         = KEY_PREFIX + "actuators::fgc_version";  // Incremented after every command
 const std::string KEY_DESIRED_JOINT_POSITIONS = KEY_PREFIX + "actuators::q_des";
 const std::string KEY_TOOL_MASS               = KEY_PREFIX + "tool::mass"; // Initialized with tool.xml
 const std::string KEY_TOOL_COM                = KEY_PREFIX + "tool::com";  // Initialized with tool.xml
@@ -35,6 +36,7 @@ const std::string KEY_TOOL_COM                = KEY_PREFIX + "tool::com";  // In
 const std::string KEY_SENSOR_TORQUES   = KEY_PREFIX + "sensors::torques";
 const std::string KEY_JOINT_POSITIONS  = KEY_PREFIX + "sensors::q";
 const std::string KEY_JOINT_VELOCITIES = KEY_PREFIX + "sensors::dq";
+const std::string KEY_PUBLISH_TIME     = KEY_PREFIX + "sensors::t_publish";  // Host CLOCK_MONOTONIC time [s]
 
 // Factory function to create VectorXd of size DOF
 Eigen::VectorXd VectorXd(double x0, double x1, double x2, double x3, double x4, double x5, double x6) {
@@ -43,7 +43,7 @@ int main (int argc, char** argv)
 	if (argc < 3) {
 		std::cout << "Usage: kuka_iiwa_driver [-s KUKA_IIWA_IP] [-p KUKA_IIWA_PORT]" << std::endl
 		          << "                        [-rs REDIS_SERVER_IP] [-rp REDIS_SERVER_PORT]" << std::endl
-		          << "                        [-t TOOL_XML]" << std::endl
+		          << "                        [-t TOOL_XML] [-perf]" << std::endl
 		          << std::endl
 		          << "This driver provides a Redis interface for communication with the Kuka IIWA." << std::endl
 		          << std::endl
@@ -58,6 +58,8 @@ int main (int argc, char** argv)
 		          << "\t\t\t\tRedis server port (default " << RedisServer::DEFAULT_PORT << ")." << std::endl
 		          << "  -t TOOL_XML" << std::endl
 		          << "\t\t\t\tKuka end-effector specification file (default " << KukaIIWA::TOOL_FILENAME << ")." << std::endl
+		          << "  -perf" << std::endl
+		          << "\t\t\t\tPrint hardware performance counters of the command loop at exit." << std::endl
 		          << std::endl;
 	}
 
@@ -67,6 +69,7 @@ int main (int argc, char** argv)
 	std::string redis_ip = RedisServer::DEFAULT_IP;
 	int redis_port = RedisServer::DEFAULT_PORT;
 	const char *tool_filename = KukaIIWA::TOOL_FILENAME;
+	bool use_perf_counters = false;
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-s")) {
 			// Kuka IIWA server IP
@@ -83,12 +86,16 @@ int main (int argc, char** argv)
 		} else if (!strcmp(argv[i], "-t")) {
 			// Tool XML
 			tool_filename = argv[++i];
+		} else if (!strcmp(argv[i], "-perf")) {
+			// Hardware performance counters
+			use_perf_counters = true;
 		}
 	}
 
 	// Create new client and UDP connection
 	KUKA::FRI::KukaIIWARedisDriver client(redis_ip, redis_port, tool_filename);
 	KUKA::FRI::UdpConnection connection;
+	if (use_perf_counters) client.enablePerfCounters();
 
 	// Connect client application to KUKA Sunrise controller.
 	// Parameter NULL means: repeat to the address, which sends the data
@@ -103,6 +110,7 @@ int main (int argc, char** argv)
 
 	// Disconnect from controller
 	app.disconnect();
+	client.printPerfCounters();
 
 	return 0;
 }
@@ -154,6 +162,11 @@ KukaIIWARedisDriver::KukaIIWARedisDriver(const std::string& redis_ip, const int
 	velocity_filter_.setDimension(LBRState::NUMBER_OF_JOINTS);
 	velocity_filter_.setCutoffFrequency(kCutoffFreq);
 
+	// Sections of command() for hardware performance counters (order of PerfSectionId)
+	perf_.addSection("command");
+	perf_.addSection("redis");
+	perf_.addSection("dynamics");
+
 	// Connect to Redis server
 	redis_.connect(redis_ip, redis_port);
 
@@ -249,6 +262,8 @@ void KukaIIWARedisDriver::waitForCommand()
 
 void KukaIIWARedisDriver::command()
 {
+	perf_.begin(PERF_COMMAND);
+
 	// Send joint values in the base command
 	LBRClient::command();
 
@@ -280,11 +295,17 @@ void KukaIIWARedisDriver::command()
 		dq_filtered_ = velocity_filter_.update(dq_);
 	}
 
+	// Host time of publishing, so controllers can phase-lock to the driver
+	timespec t_publish;
+	clock_gettime(CLOCK_MONOTONIC, &t_publish);
+
 	// Send positions, velocities and sensed torques to Redis
+	perf_.begin(PERF_REDIS);
 	redis_.pipeset({
 		{KEY_JOINT_POSITIONS,  RedisClient::encodeEigenMatrix(q_)},
 		{KEY_JOINT_VELOCITIES, RedisClient::encodeEigenMatrix(dq_filtered_)},
-		{KEY_SENSOR_TORQUES,   RedisClient::encodeEigenMatrix(sensor_torques_)}
+		{KEY_SENSOR_TORQUES,   RedisClient::encodeEigenMatrix(sensor_torques_)},
+		{KEY_PUBLISH_TIME,     std::to_string(t_publish.tv_sec + 1e-9 * t_publish.tv_nsec)}
 	});
 
 	// Read values from Redis
@@ -306,9 +327,13 @@ void KukaIIWARedisDriver::command()
 		command_torques_.setZero();
 		q_des_.setZero();
 	}
+	perf_.end(PERF_REDIS);
 
 	if (exit_program_) {
-		if (exit_counter_ <= 0) exit(0);
+		if (exit_counter_ <= 0) {
+			perf_.print();
+			exit(0);
+		}
 		command_torques_ = (-kExitKv * dq_filtered_.array()).matrix();
 		exit_counter_--;
 	}
@@ -316,6 +341,8 @@ void KukaIIWARedisDriver::command()
 	// Add gravity compensation for tool
 #ifdef USE_KUKA_LBR_DYNAMICS
 	if (fri_command_mode_ == KUKA::FRI::TORQUE) {
+		perf_.begin(PERF_DYNAMICS);
+
 		// Find ee Jacobian
 		Eigen::MatrixXd J0 = Eigen::MatrixXd::Zero(6, DOF);
 		Eigen::VectorXd q_temp = q_;
@@ -335,6 +362,8 @@ void KukaIIWARedisDriver::command()
 
 		// Compensate for ee + tool weight
 		command_torques_ -= J_ee.transpose() * F_grav_ee + J_tool.transpose() * F_grav_tool;
+
+		perf_.end(PERF_DYNAMICS);
 	}
 #endif
 
@@ -455,6 +484,8 @@ void KukaIIWARedisDriver::command()
 	command_torques_prev_ = command_torques_;
 
 	num_iters_++;
+
+	perf_.end(PERF_COMMAND);
 }
 
 
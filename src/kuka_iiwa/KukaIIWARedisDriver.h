@@ -28,6 +28,7 @@ Author: Toki Migimatsu <takatoki@stanford.edu>
 #include "friLBRClient.h"
 #include "ButterworthFilter.h"
 #include "redis/RedisClient.h"
+#include "perf/PerfCounters.h"
 
 #include <string>
 
@@ -77,6 +78,16 @@ public:
 	 */
 	void command();
 
+	/**
+	 * \brief Count hardware performance counters in command(). Call from the FRI thread.
+	 */
+	void enablePerfCounters() { perf_.enable(); }
+
+	/**
+	 * \brief Print the performance counters collected in command().
+	 */
+	void printPerfCounters() { perf_.print(); }
+
 protected:
 
 	/***** Constants *****/
@@ -155,6 +166,14 @@ protected:
 	// Number of driver iterations
 	unsigned long long num_iters_ = 0;
 
+	// Hardware performance counters for command(), with sections in order of PerfSectionId
+	enum PerfSectionId {
+		PERF_COMMAND,
+		PERF_REDIS,
+		PERF_DYNAMICS
+	};
+	PerfCounters perf_;
+
 #ifdef USE_KUKA_LBR_DYNAMICS
 	/**
  	 * \brief Parse tool.xml file.
@@ -61,6 +61,7 @@ int main() {
 	// Create a loop timer
 	LoopTimer timer;
 	timer.setLoopFrequency(1e3);   // 1 KHz
+	timer.setOverrunPolicy(LoopTimer::OVERRUN_SKIP);  // no catch-up bursts after a stall
 	timer.setCtrlCHandler(stop);    // exit while loop on ctrl-c
 	timer.initializeTimer(1e6); // 1 ms pause before starting loop
 
@@ -79,21 +80,27 @@ int main() {
 		// Joint control
 		command_torques = kp_joint * (q_initial - robot->_q) - kv_joint * robot->_dq;
 
-		// Send torques to robot
-		redis.setEigenMatrix(KukaIIWA::KEY_COMMAND_TORQUES, command_torques);
-
+		// Send torques to robot, followed by their version
 		controller_counter++;
+		redis.pipeset({
+			{KukaIIWA::KEY_COMMAND_TORQUES, RedisClient::encodeEigenMatrix(command_torques)},
+			{KukaIIWA::KEY_COMMAND_VERSION, std::to_string(controller_counter)}
+		});
 	}
 
 	// Clear torques
     command_torques.setZero();
-    redis.setEigenMatrix(KukaIIWA::KEY_COMMAND_TORQUES, command_torques);
+    redis.pipeset({
+        {KukaIIWA::KEY_COMMAND_TORQUES, RedisClient::encodeEigenMatrix(command_torques)},
+        {KukaIIWA::KEY_COMMAND_VERSION, std::to_string(++controller_counter)}
+    });
 
     double end_time = timer.elapsedTime();
     std::cout << "\n";
     std::cout << "Loop run time  : " << end_time << " seconds\n";
     std::cout << "Loop updates   : " << timer.elapsedCycles() << "\n";
     std::cout << "Loop frequency : " << timer.elapsedCycles()/end_time << "Hz\n";
+    std::cout << "Loop timing    : " << timer.statistics().toString() << "\n";
 
     return 0;
 }
@@ -287,5 +287,6 @@ int main() {
 	std::cout << "Loop run time  : " << end_time << " seconds\n";
 	std::cout << "Loop updates   : " << timer.elapsedCycles() << "\n";
 	std::cout << "Loop frequency : " << timer.elapsedCycles()/end_time << "Hz\n";
+	std::cout << "Loop timing    : " << timer.statistics().toString() << "\n";
 	return 0;
 }
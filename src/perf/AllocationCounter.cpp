@@ -0,0 +1,113 @@
+/**
+ * AllocationCounter.cpp
+ *
+ * Link into an executable to interpose the glibc allocator.
+ */
+
+#include "AllocationCounter.h"
+
+#include <cerrno>
+#include <cstddef>
+
+namespace {
+
+// Plain data only: the allocator must not allocate to reach it
+struct ThreadCounts {
+	bool counting;
+	int exempt_depth;
+	uint64_t count;
+	uint64_t exempt_count;
+};
+
+thread_local ThreadCounts t_counts = {false, 0, 0, 0};
+
+inline void countAllocation() {
+	ThreadCounts& counts = t_counts;
+	if (!counts.counting) return;
+	if (counts.exempt_depth > 0) {
+		++counts.exempt_count;
+	} else {
+		++counts.count;
+	}
+}
+
+}  // namespace
+
+#ifdef __GLIBC__
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+	countAllocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+	countAllocation();
+	return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (size > 0) countAllocation();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	countAllocation();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	countAllocation();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+	countAllocation();
+	void *result = __libc_memalign(alignment, size);
+	if (result == nullptr) return ENOMEM;
+	*ptr = result;
+	return 0;
+}
+
+}  // extern "C"
+
+bool AllocationCounter::available() { return true; }
+
+#else  // __GLIBC__
+
+bool AllocationCounter::available() { return false; }
+
+#endif  // __GLIBC__
+
+void AllocationCounter::start() {
+	t_counts.count = 0;
+	t_counts.exempt_count = 0;
+	t_counts.counting = true;
+}
+
+void AllocationCounter::stop() {
+	t_counts.counting = false;
+}
+
+uint64_t AllocationCounter::count() {
+	return t_counts.count;
+}
+
+uint64_t AllocationCounter::exemptCount() {
+	return t_counts.exempt_count;
+}
+
+AllocationCounter::Exempt::Exempt() {
+	++t_counts.exempt_depth;
+}
+
+AllocationCounter::Exempt::~Exempt() {
+	--t_counts.exempt_depth;
+}
@@ -0,0 +1,76 @@
+/**
+ * AllocationCounter.h
+ *
+ * Count the heap allocations of a thread, e.g. to check that a control
+ * loop does not allocate once it is warmed up.
+ */
+
+#ifndef SAI_ALLOCATION_COUNTER_H
+#define SAI_ALLOCATION_COUNTER_H
+
+#include <cstdint>
+
+/**
+ * Count heap allocations made by the calling thread.
+ *
+ * Linking AllocationCounter.cpp into an executable interposes malloc,
+ * calloc, realloc and the aligned allocators (glibc only), so allocations
+ * from operator new, Eigen, std::string and C libraries are all seen.
+ * Counting is per thread and off until start().
+ *
+ *   AllocationCounter::start();
+ *   runCycle();
+ *   if (AllocationCounter::count() > 0) fail();
+ *
+ * Calls into libraries that allocate by design (hiredis, the SAI2 model)
+ * can be wrapped in an AllocationCounter::Exempt scope. Their allocations
+ * are counted separately in exemptCount().
+ */
+class AllocationCounter {
+
+public:
+
+	/**
+	 * Whether allocations are counted on this platform.
+	 */
+	static bool available();
+
+	/**
+	 * Reset the counts and start counting on the calling thread.
+	 */
+	static void start();
+
+	/**
+	 * Stop counting on the calling thread.
+	 */
+	static void stop();
+
+	/**
+	 * Allocations since start() outside of Exempt scopes.
+	 */
+	static uint64_t count();
+
+	/**
+	 * Allocations since start() inside Exempt scopes.
+	 */
+	static uint64_t exemptCount();
+
+	/**
+	 * Count the allocations of the calling thread as exempt for the
+	 * lifetime of the object. Scopes may nest.
+	 */
+	class Exempt {
+
+	public:
+
+		Exempt();
+		~Exempt();
+
+		Exempt(const Exempt&) = delete;
+		Exempt& operator=(const Exempt&) = delete;
+
+	};
+
+};
+
+#endif  // SAI_ALLOCATION_COUNTER_H
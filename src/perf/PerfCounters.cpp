@@ -0,0 +1,128 @@
+/**
+ * PerfCounters.cpp
+ */
+
+#include "PerfCounters.h"
+
+#include <cstring>
+#include <iomanip>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int perfEventOpen(uint32_t type, uint64_t config, int group_fd) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = (group_fd == -1);  // Leader starts the whole group
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif  // __linux__
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		if (fds_[i] >= 0) close(fds_[i]);
+	}
+#endif  // __linux__
+}
+
+int PerfCounters::addSection(const std::string& name) {
+	sections_.emplace_back();
+	sections_.back().name = name;
+	return sections_.size() - 1;
+}
+
+bool PerfCounters::enable() {
+	if (fd_leader_ >= 0) return true;
+#ifdef __linux__
+	const uint64_t configs[NUM_EVENTS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+
+	fds_[0] = perfEventOpen(PERF_TYPE_HARDWARE, configs[0], -1);
+	if (fds_[0] < 0) {
+		std::cout << "WARNING. PerfCounters. perf_event_open failed: " << strerror(errno)
+		          << ". Check /proc/sys/kernel/perf_event_paranoid." << std::endl;
+		return false;
+	}
+	for (int i = 1; i < NUM_EVENTS; i++) {
+		fds_[i] = perfEventOpen(PERF_TYPE_HARDWARE, configs[i], fds_[0]);
+		if (fds_[i] < 0) {
+			std::cout << "WARNING. PerfCounters. perf_event_open failed: " << strerror(errno) << "." << std::endl;
+			for (int j = 0; j < i; j++) {
+				close(fds_[j]);
+				fds_[j] = -1;
+			}
+			return false;
+		}
+	}
+
+	ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	fd_leader_ = fds_[0];
+	return true;
+#else  // __linux__
+	std::cout << "WARNING. PerfCounters. Hardware counters are only supported on Linux." << std::endl;
+	return false;
+#endif  // __linux__
+}
+
+void PerfCounters::read(uint64_t values[NUM_EVENTS]) {
+#ifdef __linux__
+	// PERF_FORMAT_GROUP layout: { nr, value[nr] }
+	uint64_t buffer[1 + NUM_EVENTS];
+	if (::read(fd_leader_, buffer, sizeof(buffer)) == sizeof(buffer)) {
+		memcpy(values, buffer + 1, NUM_EVENTS * sizeof(uint64_t));
+		return;
+	}
+#endif  // __linux__
+	memset(values, 0, NUM_EVENTS * sizeof(uint64_t));
+}
+
+void PerfCounters::reset() {
+	for (auto& s : sections_) {
+		memset(s.total, 0, sizeof(s.total));
+		s.calls = 0;
+	}
+}
+
+void PerfCounters::print(std::ostream& os) const {
+	if (fd_leader_ < 0) return;
+
+	std::ios::fmtflags flags = os.flags();
+	os << "Performance counters (per call):" << std::endl
+	   << "  " << std::left << std::setw(16) << "section" << std::right
+	   << std::setw(10) << "calls"
+	   << std::setw(12) << "cycles"
+	   << std::setw(12) << "instr"
+	   << std::setw(8) << "IPC"
+	   << std::setw(12) << "cache-miss"
+	   << std::setw(12) << "branch-miss" << std::endl;
+	for (const auto& s : sections_) {
+		double n = s.calls ? static_cast<double>(s.calls) : 1.0;
+		double ipc = s.total[CYCLES] ? static_cast<double>(s.total[INSTRUCTIONS]) / s.total[CYCLES] : 0.0;
+		os << "  " << std::left << std::setw(16) << s.name << std::right << std::fixed
+		   << std::setw(10) << s.calls
+		   << std::setprecision(0)
+		   << std::setw(12) << s.total[CYCLES] / n
+		   << std::setw(12) << s.total[INSTRUCTIONS] / n
+		   << std::setprecision(2)
+		   << std::setw(8) << ipc
+		   << std::setprecision(1)
+		   << std::setw(12) << s.total[CACHE_MISSES] / n
+		   << std::setw(12) << s.total[BRANCH_MISSES] / n << std::endl;
+	}
+	os.flags(flags);
+}
@@ -0,0 +1,144 @@
+/**
+ * PerfCounters.h
+ *
+ * Hardware performance counters per named loop section.
+ */
+
+#ifndef SAI_PERF_COUNTERS_H
+#define SAI_PERF_COUNTERS_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Accumulate hardware performance counters over named sections of a loop.
+ *
+ * Counts CPU cycles, instructions, cache misses and branch misses of the
+ * calling thread with perf_event_open (user space only, so it works with the
+ * default perf_event_paranoid setting). Sections may nest.
+ *
+ *   PerfCounters perf;
+ *   int kModel = perf.addSection("model");
+ *   perf.enable();
+ *   while (running) {
+ *     perf.begin(kModel);
+ *     updateModel();
+ *     perf.end(kModel);
+ *   }
+ *   perf.print();
+ *
+ * Counters are opened for the thread that calls enable(), and begin()/end()
+ * must be called from that thread. When disabled or unavailable, begin() and
+ * end() return immediately.
+ */
+class PerfCounters {
+
+public:
+
+	enum Event {
+		CYCLES,
+		INSTRUCTIONS,
+		CACHE_MISSES,
+		BRANCH_MISSES,
+		NUM_EVENTS
+	};
+
+	PerfCounters() {}
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	/**
+	 * Register a named section.
+	 *
+	 * @param name  Section name for printing.
+	 * @return      Section id for begin() and end().
+	 */
+	int addSection(const std::string& name);
+
+	/**
+	 * Open the counters for the calling thread.
+	 *
+	 * @return  False if perf events are unavailable (non-Linux, containers,
+	 *          perf_event_paranoid > 2, ...). A warning is printed.
+	 */
+	bool enable();
+
+	/**
+	 * Whether counters are open.
+	 */
+	bool enabled() const { return fd_leader_ >= 0; }
+
+	/**
+	 * Start counting a section.
+	 */
+	inline void begin(int id) {
+		if (fd_leader_ < 0) return;
+		read(sections_[id].start);
+	}
+
+	/**
+	 * Stop counting a section and accumulate the counts since begin().
+	 */
+	inline void end(int id) {
+		if (fd_leader_ < 0) return;
+		uint64_t now[NUM_EVENTS];
+		read(now);
+		Section& s = sections_[id];
+		for (int i = 0; i < NUM_EVENTS; i++) {
+			s.total[i] += now[i] - s.start[i];
+		}
+		++s.calls;
+	}
+
+	/**
+	 * Clear accumulated counts, e.g. after a warm-up phase.
+	 */
+	void reset();
+
+	/**
+	 * Print counts per call for every section.
+	 */
+	void print(std::ostream& os = std::cout) const;
+
+protected:
+
+	struct Section {
+		std::string name;
+		uint64_t start[NUM_EVENTS] = {0};
+		uint64_t total[NUM_EVENTS] = {0};
+		uint64_t calls = 0;
+	};
+
+	/**
+	 * Read all counters of the group at once.
+	 */
+	void read(uint64_t values[NUM_EVENTS]);
+
+	std::vector<Section> sections_;
+	int fd_leader_ = -1;
+	int fds_[NUM_EVENTS] = {-1, -1, -1, -1};
+
+};
+
+/**
+ * Count a section for the lifetime of the object.
+ */
+class PerfSection {
+
+public:
+
+	PerfSection(PerfCounters& perf, int id) : perf_(perf), id_(id) { perf_.begin(id_); }
+	~PerfSection() { perf_.end(id_); }
+
+protected:
+
+	PerfCounters& perf_;
+	const int id_;
+
+};
+
+#endif  // SAI_PERF_COUNTERS_H
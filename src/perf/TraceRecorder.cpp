@@ -0,0 +1,140 @@
+/**
+ * TraceRecorder.cpp
+ */
+
+#include "TraceRecorder.h"
+
+#include <iomanip>
+#include <iostream>
+
+namespace {
+
+// Period of the writer thread
+const std::chrono::milliseconds kDrainPeriod(20);
+
+// Escape a name for a JSON string
+std::string jsonString(const std::string& s) {
+	std::string escaped = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') escaped += '\\';
+		escaped += c;
+	}
+	escaped += '"';
+	return escaped;
+}
+
+}  // namespace
+
+TraceRecorder::TraceRecorder(size_t capacity) {
+	capacity_ = 1;
+	while (capacity_ < capacity) capacity_ <<= 1;
+	mask_ = capacity_ - 1;
+}
+
+TraceRecorder::~TraceRecorder() {
+	stop();
+}
+
+int TraceRecorder::addTrack(const std::string& name) {
+	std::unique_ptr<Track> track(new Track);
+	track->name = name;
+	track->spans.resize(capacity_);
+	track->t_begin.resize(stage_names_.size(), 0);
+	tracks_.push_back(std::move(track));
+	return tracks_.size() - 1;
+}
+
+int TraceRecorder::addStage(const std::string& name) {
+	stage_names_.push_back(name);
+	for (auto& track : tracks_) {
+		track->t_begin.resize(stage_names_.size(), 0);
+	}
+	return stage_names_.size() - 1;
+}
+
+bool TraceRecorder::start(const std::string& filename) {
+	if (enabled_) return true;
+	file_.open(filename);
+	if (!file_) {
+		std::cout << "WARNING. TraceRecorder. Could not open " << filename << ". Trace disabled." << std::endl;
+		return false;
+	}
+
+	// Thread names, one viewer thread per track
+	file_ << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	first_event_ = true;
+	for (size_t i = 0; i < tracks_.size(); i++) {
+		file_ << (first_event_ ? "\n" : ",\n")
+		      << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i + 1
+		      << ",\"args\":{\"name\":" << jsonString(tracks_[i]->name) << "}}";
+		first_event_ = false;
+	}
+	file_ << std::fixed << std::setprecision(3);
+
+	t_start_ = now();
+	stopping_ = false;
+	enabled_ = true;
+	writer_ = std::thread(&TraceRecorder::writerLoop, this);
+	return true;
+}
+
+void TraceRecorder::stop() {
+	if (!enabled_) return;
+	enabled_ = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cv_.notify_all();
+	writer_.join();
+
+	// Spans recorded after the writer's last pass
+	drain();
+	file_ << "\n]}" << std::endl;
+	file_.close();
+
+	uint64_t num_dropped = dropped();
+	if (num_dropped > 0) {
+		std::cout << "WARNING. TraceRecorder. Dropped " << num_dropped << " spans. Increase the capacity." << std::endl;
+	}
+}
+
+uint64_t TraceRecorder::dropped() const {
+	uint64_t num_dropped = 0;
+	for (const auto& track : tracks_) {
+		num_dropped += track->dropped.load(std::memory_order_relaxed);
+	}
+	return num_dropped;
+}
+
+void TraceRecorder::writerLoop() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stopping_) {
+		cv_.wait_for(lock, kDrainPeriod, [this]() { return stopping_; });
+		lock.unlock();
+		drain();
+		lock.lock();
+	}
+}
+
+void TraceRecorder::drain() {
+	for (size_t i = 0; i < tracks_.size(); i++) {
+		Track& t = *tracks_[i];
+		uint64_t tail = t.tail.load(std::memory_order_relaxed);
+		uint64_t head = t.head.load(std::memory_order_acquire);
+		for (; tail < head; ++tail) {
+			const Span& span = t.spans[tail & mask_];
+
+			// Complete events, in microseconds since start()
+			file_ << (first_event_ ? "\n" : ",\n")
+			      << "{\"name\":" << jsonString(stage_names_[span.stage])
+			      << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << i + 1
+			      << ",\"ts\":" << 1e-3 * (span.t_begin - t_start_)
+			      << ",\"dur\":" << 1e-3 * (span.t_end - span.t_begin)
+			      << ",\"args\":{\"cycle\":" << span.cycle << "}}";
+			first_event_ = false;
+		}
+		t.tail.store(head, std::memory_order_release);
+	}
+	file_.flush();
+}
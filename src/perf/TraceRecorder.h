@@ -0,0 +1,179 @@
+/**
+ * TraceRecorder.h
+ *
+ * Per-cycle stage spans of a loop, written as a Chrome/Perfetto trace.
+ */
+
+#ifndef SAI_TRACE_RECORDER_H
+#define SAI_TRACE_RECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Record the begin and end times of named stages of a loop and write them
+ * as a Chrome trace (JSON), which chrome://tracing and ui.perfetto.dev open.
+ *
+ *   TraceRecorder trace;
+ *   int kControl = trace.addTrack("control");
+ *   int kModel = trace.addStage("model");
+ *   trace.start("trace.json");
+ *   while (running) {
+ *     trace.setCycle(kControl, cycle);
+ *     trace.begin(kControl, kModel);
+ *     updateModel();
+ *     trace.end(kControl, kModel);
+ *   }
+ *   trace.stop();
+ *
+ * Each track is a lock-free single-producer ring that one thread records
+ * into, shown as one thread in the viewer. A background thread drains the
+ * rings to the file, so recording takes two clock reads and a ring write
+ * and never allocates or blocks. If the writer falls behind, spans are
+ * dropped and counted. Tracks and stages are added before start(). Stages
+ * may nest within a track.
+ */
+class TraceRecorder {
+
+public:
+
+	/**
+	 * @param capacity  Spans buffered per track, rounded up to a power of 2.
+	 */
+	explicit TraceRecorder(size_t capacity = 1 << 16);
+	~TraceRecorder();
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	/**
+	 * Add a track for one recording thread.
+	 *
+	 * @param name  Thread name shown in the viewer.
+	 * @return      Track id for begin(), end() and setCycle().
+	 */
+	int addTrack(const std::string& name);
+
+	/**
+	 * Add a stage.
+	 *
+	 * @param name  Span name shown in the viewer.
+	 * @return      Stage id for begin() and end().
+	 */
+	int addStage(const std::string& name);
+
+	/**
+	 * Open the trace file and start the writer thread.
+	 *
+	 * @return  False if the file cannot be opened. A warning is printed.
+	 */
+	bool start(const std::string& filename);
+
+	/**
+	 * Write the remaining spans, close the trace and stop the writer thread.
+	 */
+	void stop();
+
+	/**
+	 * Whether spans are recorded.
+	 */
+	bool enabled() const { return enabled_; }
+
+	/**
+	 * Cycle number attached to the following spans of a track.
+	 */
+	inline void setCycle(int track, uint64_t cycle) {
+		if (!enabled_) return;
+		tracks_[track]->cycle = cycle;
+	}
+
+	/**
+	 * Start a span. Call from the track's thread.
+	 */
+	inline void begin(int track, int stage) {
+		if (!enabled_) return;
+		tracks_[track]->t_begin[stage] = now();
+	}
+
+	/**
+	 * End a span started by begin() and queue it for writing.
+	 */
+	inline void end(int track, int stage) {
+		if (!enabled_) return;
+		Track& t = *tracks_[track];
+		Span span = {t.t_begin[stage], now(), t.cycle, stage};
+		uint64_t head = t.head.load(std::memory_order_relaxed);
+		if (head - t.tail.load(std::memory_order_acquire) >= t.spans.size()) {
+			t.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		t.spans[head & mask_] = span;
+		t.head.store(head + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Spans dropped because the writer fell behind.
+	 */
+	uint64_t dropped() const;
+
+	/**
+	 * Monotonic time in nanoseconds.
+	 */
+	static inline int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+protected:
+
+	struct Span {
+		int64_t t_begin;
+		int64_t t_end;
+		uint64_t cycle;
+		int stage;
+	};
+
+	// Single-producer single-consumer ring of one thread's spans
+	struct Track {
+		std::string name;
+		std::vector<Span> spans;
+		std::vector<int64_t> t_begin;  // Per stage, producer only
+		uint64_t cycle = 0;            // Producer only
+		std::atomic<uint64_t> head{0};  // Written by the producer
+		std::atomic<uint64_t> tail{0};  // Written by the writer thread
+		std::atomic<uint64_t> dropped{0};
+	};
+
+	/**
+	 * Write the queued spans of every track. Writer thread only.
+	 */
+	void drain();
+
+	void writerLoop();
+
+	std::vector<std::unique_ptr<Track>> tracks_;
+	std::vector<std::string> stage_names_;
+	size_t capacity_;
+	uint64_t mask_;
+
+	std::atomic<bool> enabled_{false};
+	std::ofstream file_;
+	int64_t t_start_ = 0;
+	bool first_event_ = true;
+
+	std::thread writer_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stopping_ = false;
+
+};
+
+#endif  // SAI_TRACE_RECORDER_H
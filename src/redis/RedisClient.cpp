@@ -74,13 +74,19 @@ void RedisClient::del(const std::string& key) {
 }
 
 std::vector<std::string> RedisClient::pipeget(const std::vector<std::string>& keys) {
+	std::vector<std::string> values;
+	pipeget(keys, values);
+	return values;
+}
+
+void RedisClient::pipeget(const std::vector<std::string>& keys, std::vector<std::string>& values) {
 	// Prepare key list
 	for (const auto& key : keys) {
 		redisAppendCommand(context_.get(), "GET %s", key.c_str());
 	}
 
 	// Collect values
-	std::vector<std::string> values;
+	values.resize(keys.size());
 	for (size_t i = 0; i < keys.size(); i++) {
 		redisReply *r;
 		if (redisGetReply(context_.get(), (void **)&r) == REDIS_ERR)
@@ -90,9 +96,8 @@ std::vector<std::string> RedisClient::pipeget(const std::vector<std::string>& ke
 		if (reply->type != REDIS_REPLY_STRING)
 			throw std::runtime_error("RedisClient: Pipeline GET command returned non-string value for key: " + keys[i] + ".");
 
-		values.push_back(reply->str);
+		values[i].assign(reply->str, reply->len);
 	}
-	return values;
 }
 
 void RedisClient::pipeset(const std::vector<std::pair<std::string, std::string>>& keyvals) {
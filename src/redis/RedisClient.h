@@ -10,6 +10,8 @@
 
 #include <Eigen/Core>
 #include <hiredis/hiredis.h>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <vector>
 #include <thread>
@@ -127,6 +129,18 @@ public:
 	 */
 	std::vector<std::string> pipeget(const std::vector<std::string>& keys);
 
+	/**
+	 * Perform Redis GET commands in bulk into existing strings.
+	 *
+	 * Same as pipeget(keys), but reuses the storage of values, so a loop that
+	 * gets the same keys every cycle does not allocate once the strings have
+	 * grown to fit. hiredis still allocates its replies.
+	 *
+	 * @param keys    Vector of keys to get from Redis.
+	 * @param values  Retrieved values, resized to the number of keys.
+	 */
+	void pipeget(const std::vector<std::string>& keys, std::vector<std::string>& values);
+
 	/**
 	 * Perform Redis SET commands in bulk: SET key1 val1; SET key2 val2...
 	 *
@@ -194,6 +208,30 @@ public:
 #endif  // JSON_DEFAULT
 	}
 
+	/**
+	 * Encode Eigen::MatrixXd into an existing string.
+	 *
+	 * Same formats as above. The string is overwritten and keeps its
+	 * capacity, so encoding into a reserved string does not allocate.
+	 *
+	 * @param matrix  Eigen::MatrixXd to encode.
+	 * @param s       Encoded string.
+	 */
+	template<typename Derived>
+	static void encodeEigenMatrixJSON(const Eigen::MatrixBase<Derived>& matrix, std::string& s);
+
+	template<typename Derived>
+	static void encodeEigenMatrixString(const Eigen::MatrixBase<Derived>& matrix, std::string& s);
+
+	template<typename Derived>
+	static void encodeEigenMatrix(const Eigen::MatrixBase<Derived>& matrix, std::string& s) {
+#ifdef JSON_DEFAULT
+		encodeEigenMatrixJSON(matrix, s);
+#else  // JSON_DEFAULT
+		encodeEigenMatrixString(matrix, s);
+#endif  // JSON_DEFAULT
+	}
+
 	/**
  	 * Decode Eigen::MatrixXd from JSON or space-delimited string.
 	 *
@@ -219,6 +257,18 @@ public:
 		return (str[0] == '[') ? decodeEigenMatrixJSON(str) : decodeEigenMatrixString(str);
 	}
 
+	/**
+	 * Decode into an existing Eigen::Matrix without allocating.
+	 *
+	 * Both JSON and space-delimited strings are accepted. The string must
+	 * hold exactly matrix.size() numbers, in row-major order.
+	 *
+	 * @param str     String to decode.
+	 * @param matrix  Decoded Eigen::Matrix, which keeps its size.
+	 */
+	template<typename Derived>
+	static void decodeEigenMatrix(const std::string& str, Eigen::MatrixBase<Derived>& matrix);
+
 	/**
 	 * Get Eigen::MatrixXd from Redis.
 	 *
@@ -389,12 +439,37 @@ public:
 //Implementation must be part of header for compile time template specialization
 template<typename Derived>
 std::string RedisClient::encodeEigenMatrixJSON(const Eigen::MatrixBase<Derived>& matrix) {
-	std::string s = "[";
+	std::string s;
+	encodeEigenMatrixJSON(matrix, s);
+	return s;
+}
+
+template<typename Derived>
+std::string RedisClient::encodeEigenMatrixString(const Eigen::MatrixBase<Derived>& matrix) {
+	std::string s;
+	encodeEigenMatrixString(matrix, s);
+	return s;
+}
+
+// Append a number formatted like std::to_string()
+static inline void appendEigenMatrixValue(std::string& s, double value) {
+	char buffer[64];
+	int len = snprintf(buffer, sizeof(buffer), "%f", value);
+	if (len >= static_cast<int>(sizeof(buffer))) {
+		s += std::to_string(value);
+	} else if (len > 0) {
+		s.append(buffer, len);
+	}
+}
+
+template<typename Derived>
+void RedisClient::encodeEigenMatrixJSON(const Eigen::MatrixBase<Derived>& matrix, std::string& s) {
+	s = "[";
 	if (matrix.cols() == 1) { // Column vector
 		// [[1],[2],[3],[4]] => "[1,2,3,4]"
 		for (int i = 0; i < matrix.rows(); ++i) {
 			if (i > 0) s.append(",");
-			s.append(std::to_string(matrix(i,0)));
+			appendEigenMatrixValue(s, matrix(i,0));
 		}
 	} else { // Matrix
 		// [[1,2,3,4]]   => "[1,2,3,4]"
@@ -405,24 +480,23 @@ std::string RedisClient::encodeEigenMatrixJSON(const Eigen::MatrixBase<Derived>&
 			if (matrix.rows() > 1) s.append("[");
 			for (int j = 0; j < matrix.cols(); ++j) {
 				if (j > 0) s.append(",");
-				s.append(std::to_string(matrix(i,j)));
+				appendEigenMatrixValue(s, matrix(i,j));
 			}
 			// Nest arrays only if there are multiple rows
 			if (matrix.rows() > 1) s.append("]");
 		}
 	}
 	s.append("]");
-	return s;
 }
 
 template<typename Derived>
-std::string RedisClient::encodeEigenMatrixString(const Eigen::MatrixBase<Derived>& matrix) {
-	std::string s;
+void RedisClient::encodeEigenMatrixString(const Eigen::MatrixBase<Derived>& matrix, std::string& s) {
+	s.clear();
 	if (matrix.cols() == 1) { // Column vector
 		// [[1],[2],[3],[4]] => "1 2 3 4"
 		for (int i = 0; i < matrix.rows(); ++i) {
 			if (i > 0) s += " ";
-			s += std::to_string(matrix(i,0));
+			appendEigenMatrixValue(s, matrix(i,0));
 		}
 	} else { // Matrix
 		// [1,2,3,4]     => "1 2 3 4"
@@ -431,11 +505,35 @@ std::string RedisClient::encodeEigenMatrixString(const Eigen::MatrixBase<Derived
 			if (i > 0) s += "; ";
 			for (int j = 0; j < matrix.cols(); ++j) {
 				if (j > 0) s += " ";
-				s += std::to_string(matrix(i,j));
+				appendEigenMatrixValue(s, matrix(i,j));
 			}
 		}
 	}
-	return s;
+}
+
+// Skip the delimiters of both the JSON and the space-delimited format
+static inline const char *skipEigenMatrixDelimiters(const char *c) {
+	while (*c == ' ' || *c == ',' || *c == ';' || *c == '[' || *c == ']') ++c;
+	return c;
+}
+
+template<typename Derived>
+void RedisClient::decodeEigenMatrix(const std::string& str, Eigen::MatrixBase<Derived>& matrix) {
+	const char *c = str.c_str();
+	for (int i = 0; i < matrix.rows(); ++i) {
+		for (int j = 0; j < matrix.cols(); ++j) {
+			c = skipEigenMatrixDelimiters(c);
+			char *end;
+			matrix(i,j) = std::strtod(c, &end);
+			if (end == c)
+				throw std::runtime_error("RedisClient: Failed to decode " + std::to_string(matrix.rows()) + "x"
+				                         + std::to_string(matrix.cols()) + " Eigen Matrix from: " + str + ".");
+			c = end;
+		}
+	}
+	if (*skipEigenMatrixDelimiters(c) != '\0')
+		throw std::runtime_error("RedisClient: Failed to decode " + std::to_string(matrix.rows()) + "x"
+		                         + std::to_string(matrix.cols()) + " Eigen Matrix from: " + str + ".");
 }
 
 #ifdef KEEP_DEPRECATED
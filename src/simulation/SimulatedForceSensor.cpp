@@ -0,0 +1,94 @@
+#include "simulation/SimulatedForceSensor.h"
+
+SimulatedForceSensor::SimulatedForceSensor(std::shared_ptr<Simulation::SimulationInterface> sim,
+                                           const std::string& robot_name,
+                                           const std::string& link_name,
+                                           const std::string& redis_key) :
+	sim_(sim),
+	robot_name_(robot_name),
+	link_name_(link_name),
+	redis_key_(redis_key),
+	transport_(6)
+{
+	filter_.setDimension(6);
+	filter_.setCutoffFrequency(0.05);
+}
+
+void SimulatedForceSensor::setSensorFrame(const Eigen::Vector3d& pos_in_link, const Eigen::Matrix3d& R_sensor_to_link) {
+	pos_in_link_ = pos_in_link;
+	R_sensor_to_link_ = R_sensor_to_link;
+}
+
+void SimulatedForceSensor::setNoise(double stddev_force, double stddev_moment, unsigned int seed) {
+	stddev_force_ = stddev_force;
+	stddev_moment_ = stddev_moment;
+	noise_seed_ = seed;
+	rng_.seed(seed);
+}
+
+void SimulatedForceSensor::setFilterCutoff(double fc) {
+	use_filter_ = fc > 0;
+	if (use_filter_) {
+		filter_.setDimension(6);
+		filter_.setCutoffFrequency(fc);
+	}
+}
+
+void SimulatedForceSensor::setLatency(double seconds) {
+	latency_ = seconds;
+	setTransport(transport_config_, transport_seed_);
+}
+
+void SimulatedForceSensor::setTransport(const TransportChannel::Config& config, unsigned int seed) {
+	transport_config_ = config;
+	transport_seed_ = seed;
+	TransportChannel::Config config_latency = config;
+	config_latency.delay += latency_;
+	transport_.setConfig(config_latency, seed);
+}
+
+void SimulatedForceSensor::sample(double t_sim, Model::ModelInterface& robot) {
+	// Sensor pose in world coordinates
+	Eigen::Vector3d pos_sensor;
+	Eigen::Matrix3d R_link_to_world;
+	robot.position(pos_sensor, link_name_, pos_in_link_);
+	robot.rotation(R_link_to_world, link_name_);
+	Eigen::Matrix3d R_world_to_sensor = (R_link_to_world * R_sensor_to_link_).transpose();
+
+	// Resultant of the contact forces on the link about the sensor origin
+	sim_->getContactList(contact_points_, contact_forces_, robot_name_, link_name_);
+	Eigen::Vector3d force = Eigen::Vector3d::Zero();
+	Eigen::Vector3d moment = Eigen::Vector3d::Zero();
+	for (size_t i = 0; i < contact_points_.size(); i++) {
+		force += contact_forces_[i];
+		moment += (contact_points_[i] - pos_sensor).cross(contact_forces_[i]);
+	}
+
+	Eigen::VectorXd wrench(6);
+	wrench << R_world_to_sensor * force, R_world_to_sensor * moment;
+
+	// Sensor imperfections
+	wrench += bias_;
+	for (int i = 0; i < 6; i++) {
+		double stddev = (i < 3) ? stddev_force_ : stddev_moment_;
+		if (stddev > 0) wrench(i) += stddev * normal_(rng_);
+	}
+
+	// Driver filter
+	if (use_filter_) wrench = filter_.update(wrench);
+
+	// Transport
+	transport_.send(t_sim, wrench);
+}
+
+const Eigen::VectorXd& SimulatedForceSensor::output(double t_sim) {
+	return transport_.receive(t_sim);
+}
+
+void SimulatedForceSensor::reset(unsigned int seed) {
+	// Clears the filter's past inputs and outputs
+	if (use_filter_) filter_.setDimension(6);
+	rng_.seed(seed);
+	normal_.reset();
+	transport_.reset(Eigen::VectorXd::Zero(6));
+}
@@ -0,0 +1,114 @@
+#ifndef CS225A_SIMULATED_FORCE_SENSOR_H
+#define CS225A_SIMULATED_FORCE_SENSOR_H
+
+// SAI
+#include <model/ModelInterface.h>
+#include <simulation/SimulationInterface.h>
+#include "filters/ButterworthFilter.h"
+#include "simulation/TransportChannel.h"
+
+// Standard
+#include <memory>
+#include <random>
+#include <string>
+
+// External
+#include <Eigen/Core>
+
+/**
+ * 6-axis force/torque sensor mounted on a robot link, built from the
+ * simulation's contact forces on that link.
+ *
+ * Measures the wrench [F; M] (N, Nm) that the environment applies to the
+ * link, about the sensor origin and in sensor coordinates, like the
+ * Optoforce driver publishes on Optoforce::KEY_6D_SENSOR_FORCE. The
+ * measurement goes through the same stages as the real signal chain:
+ *
+ *   contact wrench -> + bias + noise -> Butterworth filter -> transport
+ */
+class SimulatedForceSensor {
+
+public:
+
+	SimulatedForceSensor(std::shared_ptr<Simulation::SimulationInterface> sim,
+	                     const std::string& robot_name,
+	                     const std::string& link_name,
+	                     const std::string& redis_key);
+
+	const std::string& robotName() const { return robot_name_; }
+	const std::string& linkName() const { return link_name_; }
+	const std::string& redisKey() const { return redis_key_; }
+
+	/***** Configuration *****/
+
+	// Sensor origin in link coordinates and rotation from sensor to link coordinates
+	void setSensorFrame(const Eigen::Vector3d& pos_in_link, const Eigen::Matrix3d& R_sensor_to_link);
+
+	// Sample rate in Hz (default 1 kHz)
+	void setSampleRate(double freq) { sample_freq_ = freq; }
+	double sampleRate() const { return sample_freq_; }
+
+	// Standard deviation of white noise on forces (N) and moments (Nm)
+	void setNoise(double stddev_force, double stddev_moment, unsigned int seed = 0);
+	unsigned int noiseSeed() const { return noise_seed_; }
+
+	// Constant offset [F; M] added to every sample
+	void setBias(const Eigen::VectorXd& bias) { bias_ = bias; }
+
+	// Cutoff of the 2nd order Butterworth filter as a fraction of the sample
+	// rate in (0, 0.5). 0 disables the filter. Default 0.05, like the driver.
+	void setFilterCutoff(double fc);
+
+	// Delay between sampling and publishing, in seconds of simulation time,
+	// added to the delay of the transport
+	void setLatency(double seconds);
+
+	// Transport between sampling and publishing, for delay, jitter, drops and holds
+	void setTransport(const TransportChannel::Config& config, unsigned int seed = 0);
+	TransportChannel& transport() { return transport_; }
+
+	/***** Simulation *****/
+
+	// Measure the contact wrench at simulation time t_sim. robot must be up
+	// to date with the simulation (link pose).
+	void sample(double t_sim, Model::ModelInterface& robot);
+
+	// Latest measurement delivered by the transport at t_sim (zero before the first)
+	const Eigen::VectorXd& output(double t_sim);
+
+	// Clear the filter and the transport and reseed the noise, e.g. after the
+	// simulation time jumped back. The same seed reproduces the same readings.
+	void reset(unsigned int seed);
+
+protected:
+
+	const std::shared_ptr<Simulation::SimulationInterface> sim_;
+	const std::string robot_name_;
+	const std::string link_name_;
+	const std::string redis_key_;
+
+	Eigen::Vector3d pos_in_link_ = Eigen::Vector3d::Zero();
+	Eigen::Matrix3d R_sensor_to_link_ = Eigen::Matrix3d::Identity();
+
+	double sample_freq_ = 1e3;
+	double stddev_force_ = 0;
+	double stddev_moment_ = 0;
+	unsigned int noise_seed_ = 0;
+	Eigen::VectorXd bias_ = Eigen::VectorXd::Zero(6);
+
+	bool use_filter_ = true;
+	ButterworthFilter filter_;
+	std::mt19937 rng_;
+	std::normal_distribution<double> normal_;
+
+	TransportChannel transport_;
+	TransportChannel::Config transport_config_;  // Without the latency
+	unsigned int transport_seed_ = 0;
+	double latency_ = 0;
+
+	std::vector<Eigen::Vector3d> contact_points_;
+	std::vector<Eigen::Vector3d> contact_forces_;
+
+};
+
+#endif  // CS225A_SIMULATED_FORCE_SENSOR_H
@@ -1,113 +1,628 @@
 #include "simulation/Simulator.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
-#include <signal.h>
 static volatile bool g_runloop = true;
-void stop(int) { g_runloop = false; }
 
-void Simulator::run() {
-	// Create a loop timer
-	timer_.setLoopFrequency(kSimulationFreq);  // 1 kHz
-	timer_.setCtrlCHandler(stop);  // Exit while loop on ctrl-c
+void Simulator::stop(int) { g_runloop = false; }
+
+bool Simulator::running() { return g_runloop; }
 
+void Simulator::initialize() {
 	// Start Redis client
 	redis_.connect(kRedisHostname, kRedisPort);
 
-	std::vector<std::string> keys_read;
-	std::vector<std::pair<std::string, std::string>> keyvals_write;
 	for (auto& r : robots_) {
 		auto zeros = Eigen::VectorXd::Zero(r.robot_->dof());
 		redis_.setEigenMatrix(r.KEY_INTERACTION_COMMAND_TORQUES, zeros);
 		redis_.setEigenMatrix(r.KEY_COMMAND_TORQUES, zeros);
 		redis_.setEigenMatrix(r.KEY_JOINT_POSITIONS, r.robot_->_q);
 		redis_.setEigenMatrix(r.KEY_JOINT_VELOCITIES, r.robot_->_dq);
+		redis_.set(r.KEY_COMMAND_VERSION, "0");
 
-		keys_read.push_back(r.KEY_INTERACTION_COMMAND_TORQUES);
-		keys_read.push_back(r.KEY_COMMAND_TORQUES);
+		keys_read_.push_back(r.KEY_INTERACTION_COMMAND_TORQUES);
+		keys_read_.push_back(r.KEY_COMMAND_TORQUES);
+		keys_version_.push_back(r.KEY_COMMAND_VERSION);
 
-		keyvals_write.emplace_back(r.KEY_JOINT_POSITIONS, "");
-		keyvals_write.emplace_back(r.KEY_JOINT_VELOCITIES, "");
-		keyvals_write.emplace_back(r.KEY_TIMESTAMP, "");
+		keyvals_write_.emplace_back(r.KEY_JOINT_POSITIONS, "");
+		keyvals_write_.emplace_back(r.KEY_JOINT_VELOCITIES, "");
+		keyvals_write_.emplace_back(r.KEY_TIMESTAMP, "");
+		keyvals_write_.emplace_back(r.KEY_HOST_TIMESTAMP, "");
 	}
 
-	auto t_sensor_write = std::chrono::high_resolution_clock::now();
-	while (g_runloop) {
-		// Wait for next scheduled loop
-		timer_.waitForNextLoop();
+	for (auto& sensor : force_sensors_) {
+		redis_.setEigenMatrix(sensor->redisKey(), Eigen::VectorXd::Zero(6));
+		keyvals_write_.emplace_back(sensor->redisKey(), "");
+	}
+	keyvals_write_.emplace_back(KEY_REAL_TIME_FACTOR, "");
+	num_keyvals_sensors_ = keyvals_write_.size();
+}
+
+size_t Simulator::robotIndex(const std::string& robot_name) const {
+	for (size_t i = 0; i < robots_.size(); i++) {
+		if (robots_[i].robot_name_ == robot_name) return i;
+	}
+	throw std::runtime_error("Simulator: no robot named '" + robot_name + "'.");
+}
+
+SimulatedForceSensor& Simulator::addForceSensor(const std::string& robot_name,
+                                                const std::string& link_name,
+                                                const std::string& redis_key) {
+	idx_force_sensor_robots_.push_back(robotIndex(robot_name));
+	force_sensors_.emplace_back(new SimulatedForceSensor(sim_, robot_name, link_name, redis_key));
+	addContactLink(robot_name, link_name);
+	return *force_sensors_.back();
+}
+
+void Simulator::sampleForceSensors(const std::vector<size_t>& idx_sensors, double t_sim) {
+	if (idx_sensors.empty()) return;
+
+	// Read the joint states of the sensors' robots, then update their models in parallel
+	robots_model_needed_.assign(robots_.size(), 0);
+	for (size_t idx_sensor : idx_sensors) {
+		size_t idx_robot = idx_force_sensor_robots_[idx_sensor];
+		if (robots_model_needed_[idx_robot]) continue;
+		readJointState(idx_robot);
+		robots_model_needed_[idx_robot] = 1;
+	}
+	updateModels(robots_model_needed_);
+
+	for (size_t idx_sensor : idx_sensors) {
+		force_sensors_[idx_sensor]->sample(t_sim, *robots_[idx_force_sensor_robots_[idx_sensor]].robot_);
+	}
+}
+
+void Simulator::setNumThreads(unsigned int num_threads) {
+	// More threads than robots would only wait
+	num_threads = std::min<unsigned int>(num_threads, robots_.size());
+	if (num_threads <= 1) {
+		pool_.reset();
+		return;
+	}
+	// Keep idle workers spinning for one integration step, so the per-step
+	// barriers don't pay for waking up sleeping threads
+	pool_.reset(new WorkerPool(num_threads, static_cast<int64_t>(1e9 / kSimulationFreq)));
+}
+
+void Simulator::forEachRobot(const std::function<void(size_t)>& task) {
+	if (pool_) {
+		pool_->parallelFor(robots_.size(), task);
+	} else {
+		for (size_t i = 0; i < robots_.size(); i++) task(i);
+	}
+}
+
+void Simulator::decodeCommandTorques(const std::vector<std::string>& redis_values, double t_sim, size_t offset) {
+	forEachRobot([&](size_t idx_robot) {
+		SimulatorRobot& r = robots_[idx_robot];
+		size_t i = offset + 2 * idx_robot;
+		Eigen::VectorXd interaction_command_torques = RedisClient::decodeEigenMatrix(redis_values[i]);
+		Eigen::VectorXd command_torques = RedisClient::decodeEigenMatrix(redis_values[i+1]);
+
+		r.command_torques_ = command_torques + interaction_command_torques;
+		r.command_channel_.send(t_sim, r.command_torques_);
+	});
+}
+
+void Simulator::setCommandTorques(double t_sim) {
+	for (auto& r : robots_) {
+		r.applied_torques_ = r.command_channel_.receive(t_sim);
+		sim_->setJointTorques(r.robot_name_, r.applied_torques_);
+	}
+}
+
+void Simulator::setTransport(const TransportChannel::Config& command_config,
+                             const TransportChannel::Config& sensor_config,
+                             unsigned int seed) {
+	for (size_t i = 0; i < robots_.size(); i++) {
+		robots_[i].command_channel_.setConfig(command_config, seed + 2 * i);
+		robots_[i].sensor_channel_.setConfig(sensor_config, seed + 2 * i + 1);
+	}
+}
+
+void Simulator::printTransportStatistics() {
+	for (auto& r : robots_) {
+		if (r.command_channel_.enabled()) {
+			std::cout << r.robot_name_ << " commands: " << r.command_channel_.statistics() << std::endl;
+		}
+		if (r.sensor_channel_.enabled()) {
+			std::cout << r.robot_name_ << " sensors : " << r.sensor_channel_.statistics() << std::endl;
+		}
+	}
+	for (auto& sensor : force_sensors_) {
+		if (sensor->transport().enabled()) {
+			std::cout << sensor->redisKey() << ": " << sensor->transport().statistics() << std::endl;
+		}
+	}
+	publishTransportStatistics();
+}
+
+void Simulator::publishTransportStatistics() {
+	for (auto& r : robots_) {
+		if (!r.command_channel_.enabled() && !r.sensor_channel_.enabled()) continue;
+		redis_.set(r.KEY_TRANSPORT_STATISTICS, "commands: " + r.command_channel_.statistics() +
+		                                       "\nsensors: " + r.sensor_channel_.statistics());
+	}
+}
+
+bool Simulator::commandVersionChanged() {
+	redis_.pipeget(keys_version_, command_versions_read_);
+	if (command_versions_read_ == command_versions_) return false;
+	command_versions_.swap(command_versions_read_);
+	return true;
+}
+
+void Simulator::readJointStates() {
+	for (size_t i = 0; i < robots_.size(); i++) {
+		readJointState(i);
+	}
+}
 
-		// Read command torques from Redis
-		auto redis_values = redis_.pipeget(keys_read);
-		int i = 0;
-		for (auto& r : robots_) {
-			Eigen::VectorXd command_torques = RedisClient::decodeEigenMatrix(redis_values[i++]);
-			Eigen::VectorXd interaction_command_torques = RedisClient::decodeEigenMatrix(redis_values[i++]);
+void Simulator::readJointState(size_t idx_robot) {
+	SimulatorRobot& r = robots_[idx_robot];
+	sim_->getJointPositions(r.robot_name_, r.robot_->_q);
+	sim_->getJointVelocities(r.robot_name_, r.robot_->_dq);
+	r.model_stale_ = true;
+}
+
+std::shared_ptr<Model::ModelInterface> Simulator::updatedModel(size_t idx_robot) {
+	SimulatorRobot& r = robots_[idx_robot];
+	if (r.model_stale_) {
+		r.robot_->updateModel();
+		r.model_stale_ = false;
+	}
+	return r.robot_;
+}
+
+void Simulator::updateModels(const std::vector<char>& needed) {
+	forEachRobot([&](size_t idx_robot) {
+		if (needed[idx_robot]) updatedModel(idx_robot);
+	});
+}
+
+double Simulator::hostTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Simulator::resetSchedule() {
+	command_read_rate_.reset(command_read_freq_, ns_sim_);
+	sensor_write_rate_.reset(kSensorWriteFreq, ns_sim_);
+	statistics_rate_.reset(1, ns_sim_);
+	force_sensor_rates_.resize(force_sensors_.size());
+	for (size_t i = 0; i < force_sensors_.size(); i++) {
+		force_sensor_rates_[i].reset(force_sensors_[i]->sampleRate(), ns_sim_);
+	}
+}
+
+void Simulator::updateRealTimeFactor(double t_sim, double t_host) {
+	if (t_host_rtf_window_ < 0 || t_sim < t_sim_rtf_window_) {
+		// First frame, or the simulation time jumped back (restore)
+		t_sim_rtf_window_ = t_sim;
+		t_host_rtf_window_ = t_host;
+		return;
+	}
+	double dt_host = t_host - t_host_rtf_window_;
+	if (dt_host < kRealTimeFactorWindow) return;
+	real_time_factor_ = (t_sim - t_sim_rtf_window_) / dt_host;
+	t_sim_rtf_window_ = t_sim;
+	t_host_rtf_window_ = t_host;
+}
+
+void Simulator::encodeSensorValues(double t_sim) {
+	const double t_host = hostTime();
+	updateRealTimeFactor(t_sim, t_host);
+
+	const std::string timestamp = std::to_string(t_sim);
+	const std::string timestamp_host = std::to_string(t_host);
+	forEachRobot([&](size_t idx_robot) {
+		SimulatorRobot& r = robots_[idx_robot];
+		size_t i = 4 * idx_robot;
+		if (r.sensor_channel_.enabled()) {
+			const int dof = r.robot_->dof();
+			Eigen::VectorXd joint_state(2 * dof);
+			joint_state << r.robot_->_q, r.robot_->_dq;
+			r.sensor_channel_.send(t_sim, joint_state);
+			const Eigen::VectorXd& joint_state_received = r.sensor_channel_.receive(t_sim);
+			keyvals_write_[i].second = RedisClient::encodeEigenMatrix(joint_state_received.head(dof));
+			keyvals_write_[i+1].second = RedisClient::encodeEigenMatrix(joint_state_received.tail(dof));
+		} else {
+			keyvals_write_[i].second = RedisClient::encodeEigenMatrix(r.robot_->_q);
+			keyvals_write_[i+1].second = RedisClient::encodeEigenMatrix(r.robot_->_dq);
+		}
+		keyvals_write_[i+2].second = timestamp;
+		keyvals_write_[i+3].second = timestamp_host;
+	});
+
+	size_t i = 4 * robots_.size();
+	for (auto& sensor : force_sensors_) {
+		keyvals_write_[i++].second = RedisClient::encodeEigenMatrix(sensor->output(t_sim));
+	}
+	keyvals_write_[i].second = std::to_string(real_time_factor_);
+}
+
+void Simulator::run() {
+	// Create a loop scheduler. With adaptive stepping one tick integrates a
+	// whole control period in a variable number of substeps.
+	scheduler_.setBaseFrequency(adaptive_ ? kSensorWriteFreq : kSimulationFreq);  // 1 or 10 kHz
+	scheduler_.timer().setCtrlCHandler(stop);  // Exit while loop on ctrl-c
+	resetSchedule();
+
+	// One integration step (or period) per tick. Everything else is due by
+	// simulation time, which only advances here, so a late timer shifts whole
+	// frames in host time instead of distorting their spacing in simulation time.
+	scheduler_.addTask("step", [&]() {
+		if (!g_runloop) {
+			scheduler_.stop();
+			return;
+		}
+
+		// Read command torques from Redis, or hold the last ones
+		const double t_sim = simTime();
+		switch (command_read_mode_) {
+			case COMMAND_READ_EVERY_STEP:
+				decodeCommandTorques(redis_.pipeget(keys_read_), t_sim);
+				break;
+			case COMMAND_READ_CONTROL_RATE:
+				if (dueAtStep(command_read_rate_)) {
+					decodeCommandTorques(redis_.pipeget(keys_read_), t_sim);
+				}
+				break;
+			case COMMAND_READ_ON_VERSION:
+				// One version round trip per control period, not per integration step
+				if (dueAtStep(command_read_rate_) && commandVersionChanged()) {
+					decodeCommandTorques(redis_.pipeget(keys_read_), t_sim);
+				}
+				break;
+		}
+		if (adaptive_) {
+			integratePeriod();
+		} else {
+			// Update simulation by 0.1 ms
+			setCommandTorques(t_sim);
+			integrateStep(1.0 / kSimulationFreq);
+		}
+
+		// Sample force sensors at their own rates, before the joint states are published
+		force_sensors_due_.clear();
+		for (size_t i = 0; i < force_sensors_.size(); i++) {
+			if (dueAtStep(force_sensor_rates_[i])) force_sensors_due_.push_back(i);
+		}
+		sampleForceSensors(force_sensors_due_, simTime());
 
-			sim_->setJointTorques(r.robot_name_, command_torques + interaction_command_torques);
+		// Write joint kinematics to Redis at the sensor rate
+		if (dueAtStep(sensor_write_rate_)) {
+			readJointStates();
+			encodeSensorValues(simTime());
+			redis_.pipeset(keyvals_write_);
 		}
 
-		// Update simulation by 0.1 ms
-		sim_->integrate(1.0 / kSimulationFreq);
+		// Publish transport statistics once per second
+		if (dueAtStep(statistics_rate_)) publishTransportStatistics();
+	});
 
-		// Update models
-		for (auto& r : robots_) {
-			sim_->getJointPositions(r.robot_name_, r.robot_->_q);
-			sim_->getJointVelocities(r.robot_name_, r.robot_->_dq);
-			r.robot_->updateModel();
+	double t_host_start = hostTime();
+	double t_sim_start = simTime();
+	scheduler_.run();
+	scheduler_.printStatistics();
+
+	double t_wall = hostTime() - t_host_start;
+	double t_sim = simTime() - t_sim_start;
+	std::cout << "Simulation time     : " << t_sim << " seconds" << std::endl
+	          << "Wall time           : " << t_wall << " seconds" << std::endl
+	          << "Real-time factor    : " << (t_wall > 0 ? t_sim / t_wall : 0) << std::endl;
+	printSubstepStatistics();
+	printTransportStatistics();
+}
+
+void Simulator::initializeLockstep() {
+	// Acknowledgements are read before the torques, so when a controller has
+	// acknowledged step k its torques are the ones it computed for k
+	keys_read_lockstep_.clear();
+	for (auto& r : robots_) {
+		redis_.set(r.KEY_COMMAND_STEP, "-1");
+		keys_read_lockstep_.push_back(r.KEY_COMMAND_STEP);
+	}
+	keys_read_lockstep_.insert(keys_read_lockstep_.end(), keys_read_.begin(), keys_read_.end());
+	redis_.set(KEY_SNAPSHOT_COMMAND, "");
+	keys_read_lockstep_.push_back(KEY_SNAPSHOT_COMMAND);
+
+	// The step number is written after the sensor values it refers to
+	keyvals_write_.resize(num_keyvals_sensors_);
+	idx_keyvals_step_ = keyvals_write_.size();
+	for (auto& r : robots_) {
+		keyvals_write_.emplace_back(r.KEY_SIM_STEP, "");
+	}
+
+	lockstep_step_ = 0;
+	ns_sim_ = 0;
+	resetSchedule();
+	lockstep_published_ = false;
+}
+
+bool Simulator::stepLockstep() {
+	// Publish step k
+	if (!lockstep_published_) {
+		force_sensors_due_.clear();
+		for (size_t i = 0; i < force_sensors_.size(); i++) {
+			if (dueAtStep(force_sensor_rates_[i])) force_sensors_due_.push_back(i);
 		}
-		
-		auto t_curr = std::chrono::high_resolution_clock::now();
-		if (std::chrono::duration<double>(t_curr - t_sensor_write).count() >= 1.0 / kSensorWriteFreq) {
-			// Write joint kinematics to Redis
-			i = 0;
-			for (auto& r : robots_) {
-				keyvals_write[i++].second = RedisClient::encodeEigenMatrix(r.robot_->_q);
-				keyvals_write[i++].second = RedisClient::encodeEigenMatrix(r.robot_->_dq);
-				keyvals_write[i++].second = std::to_string(timer_.elapsedSimTime());
-			}
-			redis_.pipeset(keyvals_write);
-
-			t_sensor_write = t_curr;
+		sampleForceSensors(force_sensors_due_, lockstepTime());
+		readJointStates();
+		encodeSensorValues(lockstepTime());
+		for (size_t i = idx_keyvals_step_; i < keyvals_write_.size(); i++) {
+			keyvals_write_[i].second = std::to_string(lockstep_step_);
 		}
+		redis_.pipeset(keyvals_write_);
+		lockstep_published_ = true;
+	}
 
+	// Check whether every controller has acknowledged step k with its command
+	auto redis_values = redis_.pipeget(keys_read_lockstep_);
+	if (!redis_values.back().empty()) {
+		redis_.set(KEY_SNAPSHOT_COMMAND, "");
+		if (executeSnapshotCommand(redis_values.back())) return false;
+	}
+	for (size_t i = 0; i < robots_.size(); i++) {
+		if (std::stoll(redis_values[i]) != lockstep_step_) return false;
 	}
 
-	// Clean up keys
+	// Integrate one command period, held over the integration steps in between
+	decodeCommandTorques(redis_values, lockstepTime(), robots_.size());
+	integratePeriod();
+	lockstep_step_++;
+	if (lockstep_step_ % static_cast<long long>(kSensorWriteFreq) == 0) {
+		publishTransportStatistics();
+	}
+	lockstep_published_ = false;
+	return true;
+}
+
+void Simulator::runLockstep() {
+	initializeLockstep();
+
+	std::cout << "Lockstep simulation. Waiting for controllers to acknowledge "
+	          << robots_[0].KEY_SIM_STEP << " on " << robots_[0].KEY_COMMAND_STEP << "." << std::endl;
+
+	auto t_start = std::chrono::steady_clock::now();
+	while (g_runloop) {
+		if (!stepLockstep()) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(kLockstepPollPeriod));
+		}
+	}
+
+	double t_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+	double t_sim = lockstepTime();
+	std::cout << "Lockstep steps      : " << lockstep_step_ << std::endl
+	          << "Simulation time     : " << t_sim << " seconds" << std::endl
+	          << "Wall time           : " << t_wall << " seconds" << std::endl
+	          << "Real-time factor    : " << (t_wall > 0 ? t_sim / t_wall : 0) << std::endl;
+	printSubstepStatistics();
+	printTransportStatistics();
+}
+
+void Simulator::runHeadless(double duration) {
+	const long long num_periods = static_cast<long long>(duration * kSensorWriteFreq);
+
+	auto t_start = std::chrono::steady_clock::now();
+	for (long long period = 0; period < num_periods && g_runloop; period++) {
+		integratePeriod();
+	}
+
+	double t_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+	double t_sim = simTime();
+	std::cout << "Headless steps      : " << num_integration_steps_ << std::endl
+	          << "Simulation time     : " << t_sim << " seconds" << std::endl
+	          << "Wall time           : " << t_wall << " seconds" << std::endl
+	          << "Real-time factor    : " << (t_wall > 0 ? t_sim / t_wall : 0) << std::endl;
+	printSubstepStatistics();
+}
+
+void Simulator::setRecording(const std::string& filename, unsigned int every_n_steps) {
+	std::vector<int> dofs;
+	for (const auto& r : robots_) {
+		dofs.push_back(r.robot_->dof());
+	}
+	recorder_.open(filename, dofs);
+	record_every_ = every_n_steps > 0 ? every_n_steps : 1;
+}
+
+void Simulator::integrateStep(double dt) {
+	sim_->integrate(dt);
+	ns_sim_ += std::llround(1e9 * dt);
+	++num_integration_steps_;
+	if (!recorder_.isOpen() || num_integration_steps_ % record_every_ != 0) return;
+
+	// t_sim, then q, dq and applied torques of every robot
+	double *record = recorder_.append();
+	*record++ = simTime();
 	for (auto& r : robots_) {
-		redis_.del(r.KEY_JOINT_POSITIONS);
-		redis_.del(r.KEY_JOINT_VELOCITIES);
+		const int dof = r.robot_->dof();
+		sim_->getJointPositions(r.robot_name_, r.robot_->_q);
+		sim_->getJointVelocities(r.robot_name_, r.robot_->_dq);
+		r.model_stale_ = true;
+		Eigen::Map<Eigen::VectorXd>(record, dof) = r.robot_->_q;
+		Eigen::Map<Eigen::VectorXd>(record + dof, dof) = r.robot_->_dq;
+		Eigen::Map<Eigen::VectorXd>(record + 2 * dof, dof) = r.applied_torques_;
+		record += 3 * dof;
+	}
+}
+
+void Simulator::integratePeriod() {
+	const int64_t ns_period = std::llround(1e9 / kSensorWriteFreq);
+	unsigned int num_substeps = static_cast<unsigned int>(kSimulationFreq / kSensorWriteFreq);
+	if (adaptive_) {
+		num_substeps = chooseSubsteps();
+		substep_counts_[num_substeps]++;
 	}
+
+	// Commands delayed by the transport may arrive in between, so they are
+	// applied at every substep. Substeps divide the period in whole
+	// nanoseconds, so the period ends exactly on the next sensor write.
+	const double dt = 1e-9 * (ns_period / num_substeps);
+	for (unsigned int i = 0; i < num_substeps; i++) {
+		setCommandTorques(simTime());
+		integrateStep(dt);
+	}
+}
+
+void Simulator::setAdaptiveStepping(const AdaptiveStepping& config) {
+	// Substep counts must divide the control period in whole nanoseconds
+	const int64_t ns_period = std::llround(1e9 / kSensorWriteFreq);
+	adaptive_config_ = config;
+	adaptive_config_.min_substeps = std::max(1u, config.min_substeps);
+	adaptive_config_.max_substeps = std::max(adaptive_config_.min_substeps, config.max_substeps);
+	while (ns_period % adaptive_config_.max_substeps != 0) adaptive_config_.max_substeps++;
+	adaptive_ = true;
+}
+
+void Simulator::addContactLink(const std::string& robot_name, const std::string& link_name) {
+	contact_links_.emplace_back(robotIndex(robot_name), link_name);
 }
 
-int main(int argc, char** argv) {
-	// Parse command line
-	if (argc < 4 || argc % 2 != 0) {
-		std::cout << "Usage: simulator <path-to-world.urdf> <path-to-robot-1.urdf> <robot-name-1> ..." << std::endl;
-		exit(0);
+unsigned int Simulator::chooseSubsteps() {
+	const AdaptiveStepping& config = adaptive_config_;
+
+	// Contact: the finest step, held for a while after the contact ends so
+	// bouncing in and out of contact doesn't switch back and forth
+	bool contact = false;
+	for (const auto& link : contact_links_) {
+		sim_->getContactList(contact_points_, contact_forces_, robots_[link.first].robot_name_, link.second);
+		if (!contact_points_.empty()) {
+			contact = true;
+			break;
+		}
+	}
+	if (contact) {
+		contact_hold_ = config.contact_hold_periods;
+	} else if (contact_hold_ > 0) {
+		contact_hold_--;
+	}
+	if (contact || contact_hold_ > 0) return config.max_substeps;
+
+	// Free space: enough substeps to bound the joint motion per substep,
+	// which also bounds how deep a link can penetrate before contact is seen
+	double dq_max = 0;
+	for (size_t i = 0; i < robots_.size(); i++) {
+		readJointState(i);
+		dq_max = std::max(dq_max, robots_[i].robot_->_dq.lpNorm<Eigen::Infinity>());
+	}
+	unsigned int num_substeps = config.min_substeps;
+	if (config.max_joint_step > 0) {
+		double substeps = std::ceil(dq_max / (kSensorWriteFreq * config.max_joint_step));
+		if (substeps > num_substeps) {
+			num_substeps = static_cast<unsigned int>(std::min<double>(substeps, config.max_substeps));
+		}
 	}
 
-	// Argument 0: executable name
-	// Argument 1: <path-to-world.urdf>
-	std::string world_file(argv[1]);
+	// Round up to a count that divides the period in whole nanoseconds
+	const int64_t ns_period = std::llround(1e9 / kSensorWriteFreq);
+	while (ns_period % num_substeps != 0) num_substeps++;
+	return std::min(num_substeps, config.max_substeps);
+}
+
+void Simulator::printSubstepStatistics() {
+	if (!adaptive_) return;
 
-	// Load robots
-	std::vector<std::string> robot_names;
-	std::vector<std::shared_ptr<Model::ModelInterface>> robots;
-	for (int i = 2; i < argc; i += 2) {
-		// Argument 2: <path-to-robot.urdf>
-		robots.push_back(std::make_shared<Model::ModelInterface>(std::string(argv[i]), Model::rbdl, Model::urdf, false));
-		// Argument 3: <robot-name>
-		robot_names.emplace_back(argv[i+1]);
+	unsigned long long num_periods = 0;
+	unsigned long long num_substeps = 0;
+	for (const auto& count : substep_counts_) {
+		num_periods += count.second;
+		num_substeps += count.first * count.second;
 	}
+	if (num_periods == 0) return;
 
-	// Set up signal handler
-	signal(SIGABRT, &stop);
-	signal(SIGTERM, &stop);
-	signal(SIGINT, &stop);
+	std::cout << "Substeps per period : mean " << static_cast<double>(num_substeps) / num_periods
+	          << " (fixed " << kSimulationFreq / kSensorWriteFreq << ") |";
+	for (const auto& count : substep_counts_) {
+		std::cout << " " << count.first << ": " << 100.0 * count.second / num_periods << "%";
+	}
+	std::cout << std::endl;
+}
+
+void Simulator::snapshot(SimulatorSnapshot& snapshot) {
+	readJointStates();
 
-	// Load simulation world
-	auto sim = std::make_shared<Simulation::SimulationInterface>(world_file, Simulation::sai2simulation, Simulation::urdf, false);
+	auto& data = snapshot.data;
+	data.clear();
+	data.push_back(lockstep_step_);
+	data.push_back(ns_sim_);  // Exact in a double for 104 days
+	for (const auto& r : robots_) {
+		data.insert(data.end(), r.robot_->_q.data(), r.robot_->_q.data() + r.robot_->_q.size());
+		data.insert(data.end(), r.robot_->_dq.data(), r.robot_->_dq.data() + r.robot_->_dq.size());
+		data.insert(data.end(), r.command_torques_.data(), r.command_torques_.data() + r.command_torques_.size());
+	}
+}
 
-	Simulator app(sim, robots, robot_names);
-	app.run();
+void Simulator::restore(const SimulatorSnapshot& snapshot) {
+	size_t size = 2;
+	for (const auto& r : robots_) {
+		size += 3 * r.robot_->dof();
+	}
+	if (snapshot.data.size() != size) {
+		throw std::runtime_error("Simulator: snapshot does not match the simulated robots.");
+	}
+
+	const double *data = snapshot.data.data();
+	lockstep_step_ = static_cast<long long>(*data++);
+	ns_sim_ = static_cast<int64_t>(*data++);
+	resetSchedule();
+	contact_hold_ = 0;
+	for (auto& r : robots_) {
+		const int dof = r.robot_->dof();
+		Eigen::Map<const Eigen::VectorXd> q(data, dof);
+		Eigen::Map<const Eigen::VectorXd> dq(data + dof, dof);
+		r.command_torques_ = Eigen::Map<const Eigen::VectorXd>(data + 2 * dof, dof);
+		data += 3 * dof;
+
+		// Drop whatever was in transit after the restored time
+		r.command_channel_.reset(r.command_torques_);
+		r.sensor_channel_.reset(Eigen::VectorXd());
+
+		sim_->setJointPositions(r.robot_name_, q);
+		sim_->setJointVelocities(r.robot_name_, dq);
+	}
+	for (auto& sensor : force_sensors_) {
+		sensor->reset(sensor->noiseSeed());
+	}
+	setCommandTorques(simTime());
+	readJointStates();
+	lockstep_published_ = false;
+}
+
+bool Simulator::executeSnapshotCommand(const std::string& command) {
+	std::stringstream ss(command);
+	std::string action, name;
+	ss >> action >> name;
+
+	if (action == "save") {
+		snapshot(snapshots_[name]);
+		std::cout << "Saved snapshot '" << name << "' at t = " << simTime() << "." << std::endl;
+	} else if (action == "restore" && snapshots_.count(name)) {
+		restore(snapshots_[name]);
+		std::cout << "Restored snapshot '" << name << "' at t = " << simTime() << "." << std::endl;
+		return true;
+	} else {
+		std::cout << "WARNING. Simulator. Ignoring snapshot command '" << command << "'." << std::endl;
+	}
+	return false;
+}
+
+void Simulator::cleanup() {
+	// Clean up keys
+	for (auto& r : robots_) {
+		redis_.del(r.KEY_JOINT_POSITIONS);
+		redis_.del(r.KEY_JOINT_VELOCITIES);
+		redis_.del(r.KEY_SIM_STEP);
+		redis_.del(r.KEY_COMMAND_STEP);
+		redis_.del(r.KEY_COMMAND_VERSION);
+		redis_.del(r.KEY_HOST_TIMESTAMP);
+		redis_.del(r.KEY_TRANSPORT_STATISTICS);
+	}
+	redis_.del(KEY_SNAPSHOT_COMMAND);
+	redis_.del(KEY_REAL_TIME_FACTOR);
 }
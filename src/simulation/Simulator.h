@@ -5,9 +5,19 @@
 #include <model/ModelInterface.h>
 #include <simulation/SimulationInterface.h>
 #include "redis/RedisClient.h"
-#include "timer/LoopTimer.h"
+#include "timer/LoopScheduler.h"
+#include "concurrency/WorkerPool.h"
+#include "simulation/StateRecorder.h"
+#include "simulation/SimulatedForceSensor.h"
+#include "simulation/TransportChannel.h"
 
 // Standard
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
 #include <thread>
 
@@ -16,29 +26,87 @@
 
 struct SimulatorRobot {
 
-	const std::string kRedisKeyPrefix = "cs225a::";
+	const std::string kRedisKeyPrefix;
 	const std::string KEY_INTERACTION_COMMAND_TORQUES;
 	const std::string KEY_COMMAND_TORQUES;
 	const std::string KEY_JOINT_POSITIONS;
 	const std::string KEY_JOINT_VELOCITIES;
-	const std::string KEY_TIMESTAMP;
+	const std::string KEY_TIMESTAMP;       // Simulation time of the published joint states
+	const std::string KEY_HOST_TIMESTAMP;  // Host monotonic time at which they were published
+	const std::string KEY_COMMAND_VERSION;  // Incremented by the controller with every command
+	const std::string KEY_SIM_STEP;      // Lockstep: step published by the simulator
+	const std::string KEY_COMMAND_STEP;  // Lockstep: step acknowledged by the controller
+	const std::string KEY_TRANSPORT_STATISTICS;
 
 	const std::shared_ptr<Model::ModelInterface> robot_;
 	const std::string robot_name_;
 
-	SimulatorRobot(std::shared_ptr<Model::ModelInterface> robot, const std::string& robot_name) :
+	// Last command read from Redis, held between reads
+	Eigen::VectorXd command_torques_;
+
+	// Command torques that reached the simulation through command_channel_
+	Eigen::VectorXd applied_torques_;
+
+	// Simulated transport of commands from Redis to the simulation, and of
+	// joint states [q; dq] from the simulation to Redis
+	TransportChannel command_channel_;
+	TransportChannel sensor_channel_;
+
+	// robot_->_q and _dq changed since the last robot_->updateModel()
+	bool model_stale_ = true;
+
+	SimulatorRobot(std::shared_ptr<Model::ModelInterface> robot, const std::string& robot_name,
+	               const std::string& redis_key_prefix) :
+		kRedisKeyPrefix(redis_key_prefix),
 		KEY_INTERACTION_COMMAND_TORQUES(kRedisKeyPrefix + robot_name + "::actuators::fgc_interact"),
 		KEY_COMMAND_TORQUES            (kRedisKeyPrefix + robot_name + "::actuators::fgc"),
 		KEY_JOINT_POSITIONS            (kRedisKeyPrefix + robot_name + "::sensors::q"),
 		KEY_JOINT_VELOCITIES           (kRedisKeyPrefix + robot_name + "::sensors::dq"),
 		KEY_TIMESTAMP                  (kRedisKeyPrefix + robot_name + "::timestamp"),
+		KEY_HOST_TIMESTAMP             (kRedisKeyPrefix + robot_name + "::timestamp_host"),
+		KEY_COMMAND_VERSION            (kRedisKeyPrefix + robot_name + "::actuators::fgc_version"),
+		KEY_SIM_STEP                   (kRedisKeyPrefix + robot_name + "::sim::step"),
+		KEY_COMMAND_STEP               (kRedisKeyPrefix + robot_name + "::actuators::step"),
+		KEY_TRANSPORT_STATISTICS       (kRedisKeyPrefix + robot_name + "::sim::transport"),
 		robot_(robot),
-		robot_name_(robot_name)
+		robot_name_(robot_name),
+		command_channel_(robot->dof())
 	{
 		robot->_q.setZero();
 		robot->_dq.setZero();
+		command_torques_ = Eigen::VectorXd::Zero(robot->dof());
+		applied_torques_ = command_torques_;
+	}
+
+};
+
+// Restorable simulator state packed into one buffer: the lockstep step, the
+// simulation time in nanoseconds, then q, dq and the held command torques of
+// every robot.
+struct SimulatorSnapshot {
+	std::vector<double> data;
+};
+
+// Event at a fixed rate in simulation time. It is due at the first step at
+// or after each multiple of its period, so a period that is not a multiple
+// of the step keeps its rate on average: 300 Hz on 1 ms steps fires after
+// 4, 3 and 3 ms.
+struct SimulatorRate {
+	int64_t ns_period = 1;
+	int64_t ns_next = 0;
+
+	// Set the rate and wait for the first multiple of its period at or after ns_sim
+	void reset(double freq, int64_t ns_sim) {
+		ns_period = std::max<int64_t>(1, std::llround(1e9 / freq));
+		ns_next = (ns_sim + ns_period - 1) / ns_period * ns_period;
 	}
 
+	// Whether the event is due at ns_sim. Missed periods are skipped, not repeated.
+	bool due(int64_t ns_sim) {
+		if (ns_sim < ns_next) return false;
+		ns_next += ((ns_sim - ns_next) / ns_period + 1) * ns_period;
+		return true;
+	}
 };
 
 class Simulator {
@@ -47,33 +115,273 @@ public:
 
 	Simulator(std::shared_ptr<Simulation::SimulationInterface> sim,
 	          const std::vector<std::shared_ptr<Model::ModelInterface>>& robots,
-	          const std::vector<std::string>& robot_names) :
+	          const std::vector<std::string>& robot_names,
+	          const std::string& redis_key_prefix = "cs225a::") :
+		KEY_SNAPSHOT_COMMAND(redis_key_prefix + "sim::snapshot"),
+		KEY_REAL_TIME_FACTOR(redis_key_prefix + "sim::real_time_factor"),
 		sim_(sim)
 	{
 		for (int i = 0; i < robots.size(); i++) {
-			robots_.emplace_back(robots[i], robot_names[i]);
+			robots_.emplace_back(robots[i], robot_names[i], redis_key_prefix);
 		}
 	}
 
+	/***** Enums *****/
+
+	// When run() reads command torques from Redis. Between reads the last
+	// command is held (zero-order hold).
+	enum CommandReadMode {
+		COMMAND_READ_EVERY_STEP,    // Every integration step
+		COMMAND_READ_CONTROL_RATE,  // At command_read_freq_
+		COMMAND_READ_ON_VERSION     // When a controller bumps KEY_COMMAND_VERSION, checked at
+		                            // command_read_freq_. Controllers must write the version
+		                            // after their torques (DemoProject, kuka_hold_pos, screwCapTask).
+	};
+
+	// Substeps per control period in adaptive integration. The period is
+	// split into min_substeps steps in free space. Contact on a monitored
+	// link switches to max_substeps until contact_hold_periods after it
+	// ends, and in between fast joints get enough substeps that no joint
+	// moves more than max_joint_step per substep.
+	struct AdaptiveStepping {
+		unsigned int min_substeps = 2;
+		unsigned int max_substeps = 10;         // 10 = the fixed 10 kHz step
+		double max_joint_step = 2e-3;           // rad or m per substep
+		unsigned int contact_hold_periods = 20;
+	};
+
 	/***** Constants *****/
 
 	const double kSensorWriteFreq = 1e3;
 	const double kSimulationFreq = 1e4;
 
+	// Lockstep: pause between acknowledgement checks while no controller has
+	// answered, so the simulator and the controllers don't race on Redis
+	const double kLockstepPollPeriod = 20e-6;
+
 	const std::string kRedisHostname = "127.0.0.1";
 	const int kRedisPort = 6379;
 
+	// Lockstep: "save <name>" or "restore <name>", polled with the acknowledgements
+	const std::string KEY_SNAPSHOT_COMMAND;
+
+	// Simulation time over host time, over the last kRealTimeFactorWindow
+	// seconds of host time. Published with the joint states.
+	const std::string KEY_REAL_TIME_FACTOR;
+	const double kRealTimeFactorWindow = 0.1;
+
 	/***** Member functions *****/
 
+	// Stop the loops of all simulators in this process. Signal handler.
+	static void stop(int signal = 0);
+	static bool running();
+
+	void initialize();
+
+	// Integrate on a 10 kHz timer, reading whatever commands are in Redis.
+	// Command reads, force sensor samples and joint state writes are due by
+	// simulation time, so they stay evenly spaced in simulation time when
+	// the timer falls behind.
 	void run();
 
+	// Publish step k and integrate it only once every controller has
+	// acknowledged k on KEY_COMMAND_STEP. Runs as fast as the controllers.
+	void runLockstep();
+
+	// Lockstep as a non-blocking state machine, so one thread can drive
+	// many simulators. stepLockstep() publishes the current step if it has
+	// not been published yet and checks the acknowledgements once. If all
+	// controllers have acknowledged it integrates the step and returns true.
+	// Callers should back off for kLockstepPollPeriod when it returns false.
+	void initializeLockstep();
+	bool stepLockstep();
+	long long lockstepStep() const { return lockstep_step_; }
+	double lockstepTime() const { return lockstep_step_ / kSensorWriteFreq; }
+
+	// Integrate for duration seconds of sim time as fast as possible, without
+	// Redis, holding the current command torques. For recording and benchmarks.
+	void runHeadless(double duration);
+
+	void cleanup();
+
+	// Add a simulated 6-axis force/torque sensor on a robot link, published
+	// on redis_key with the joint states. Call before initialize().
+	SimulatedForceSensor& addForceSensor(const std::string& robot_name,
+	                                     const std::string& link_name,
+	                                     const std::string& redis_key);
+
+	// Sample the listed force sensors at t_sim from fresh link kinematics.
+	// The models of their robots are updated together, in parallel.
+	void sampleForceSensors(const std::vector<size_t>& idx_sensors, double t_sim);
+
+	// Index of the named robot in robots_
+	size_t robotIndex(const std::string& robot_name) const;
+
+	// Record q, dq, applied torques and sim time of every robot after every
+	// Nth integration step to a memory-mapped log (see StateRecorder)
+	void setRecording(const std::string& filename, unsigned int every_n_steps = 1);
+
+	// Integrate one step of dt seconds and record it if due
+	void integrateStep(double dt);
+
+	// Integrate one control period of 1 / kSensorWriteFreq, applying the
+	// commands at every substep. Fixed 1 / kSimulationFreq substeps, or
+	// chooseSubsteps() of them with adaptive stepping.
+	void integratePeriod();
+
+	// Integrate with a variable number of substeps per control period. Call
+	// before initialize(). Force sensor links are monitored for contact.
+	void setAdaptiveStepping(const AdaptiveStepping& config);
+	void addContactLink(const std::string& robot_name, const std::string& link_name);
+
+	// Substeps for the next control period, from contacts and joint velocities
+	unsigned int chooseSubsteps();
+
+	// Print how many control periods were integrated with each substep count
+	void printSubstepStatistics();
+
+	// Simulation time in seconds, kept in integer nanoseconds so substeps
+	// add up to exact control periods
+	double simTime() const { return 1e-9 * ns_sim_; }
+
+	// Whether an event is due at the current simulation time
+	bool dueAtStep(SimulatorRate& rate) { return rate.due(ns_sim_); }
+
+	// Restart every rate at the current simulation time, e.g. after it jumped
+	void resetSchedule();
+
+	// Host monotonic time in seconds (CLOCK_MONOTONIC on Linux)
+	static double hostTime();
+
+	// Copy the simulator state into snapshot, reusing its buffer
+	void snapshot(SimulatorSnapshot& snapshot);
+
+	// Return to a snapshot taken from this simulator. In lockstep the
+	// restored step is published again for the controllers.
+	void restore(const SimulatorSnapshot& snapshot);
+
+	// Execute a command from KEY_SNAPSHOT_COMMAND. Returns true on restore.
+	bool executeSnapshotCommand(const std::string& command);
+
+	// Impair the command and joint state transport of every robot with
+	// delay, jitter, drops and sample-and-hold, in simulation time. Joint
+	// states are only published at kSensorWriteFreq, so their delays are
+	// effectively rounded up to sensor periods. Call before initialize().
+	void setTransport(const TransportChannel::Config& command_config,
+	                  const TransportChannel::Config& sensor_config,
+	                  unsigned int seed = 0);
+
+	// Print the statistics of every impaired channel, and publish them on
+	// <robot>::sim::transport
+	void printTransportStatistics();
+	void publishTransportStatistics();
+
+	void setCommandReadMode(CommandReadMode mode, double command_read_freq = 1e3) {
+		command_read_mode_ = mode;
+		command_read_freq_ = command_read_freq;
+	}
+
+	// Run the per-robot stages (decode, model update, encode) on num_threads
+	// threads. Calls into sim_ and Redis stay on the simulation thread, and
+	// each stage completes before the next one, so integrate() always sees
+	// every robot's torques. 1 runs everything on the simulation thread.
+	// At most one thread per robot is used. Idle workers busy-wait for one
+	// integration step before sleeping, so each extra thread keeps a core busy.
+	void setNumThreads(unsigned int num_threads);
+
+	// Call task(idx_robot) for every robot, on the worker pool if there is one
+	void forEachRobot(const std::function<void(size_t)>& task);
+
+	// Decode command + interaction torques from keys_read_ values into the
+	// hold and send them to the simulation at t_sim
+	void decodeCommandTorques(const std::vector<std::string>& redis_values, double t_sim, size_t offset = 0);
+
+	// Apply the command torques that have arrived by t_sim to the simulation
+	void setCommandTorques(double t_sim);
+
+	// Fetch the command versions and return true if any changed since the last call.
+	// Reuses the storage of the previous versions.
+	bool commandVersionChanged();
+
+	// Read joint kinematics from the simulation into the robot models. The
+	// models themselves are only updated on demand by updatedModel().
+	void readJointStates();
+	void readJointState(size_t idx_robot);
+
+	// Robot model with kinematics and dynamics at the last joint state read,
+	// for consumers that need more than q and dq (sensors, UI, logging).
+	// Updates the model at most once per readJointStates().
+	std::shared_ptr<Model::ModelInterface> updatedModel(size_t idx_robot);
+
+	// Bring the stale models of the robots with needed[idx_robot] set up to
+	// date, in parallel
+	void updateModels(const std::vector<char>& needed);
+
+	// Encode joint kinematics, the simulation and host timestamps, force
+	// sensor outputs and the real-time factor into keyvals_write_
+	void encodeSensorValues(double t_sim);
+
+	// Update the real-time factor at a published frame
+	void updateRealTimeFactor(double t_sim, double t_host);
+	double realTimeFactor() const { return real_time_factor_; }
+
 	/***** Member variables *****/
 
 	const std::shared_ptr<Simulation::SimulationInterface> sim_;
 	std::vector<struct SimulatorRobot> robots_;
 
-	LoopTimer timer_;
+	LoopScheduler scheduler_;
 	RedisClient redis_;
+	std::unique_ptr<WorkerPool> pool_;
+
+	StateRecorder recorder_;
+	unsigned int record_every_ = 1;
+	unsigned long long num_integration_steps_ = 0;
+	int64_t ns_sim_ = 0;
+
+	// Adaptive stepping
+	bool adaptive_ = false;
+	AdaptiveStepping adaptive_config_;
+	std::vector<std::pair<size_t, std::string>> contact_links_;  // (robot index, link)
+	unsigned int contact_hold_ = 0;
+	std::map<unsigned int, unsigned long long> substep_counts_;  // substeps -> periods
+	std::vector<Eigen::Vector3d> contact_points_;
+	std::vector<Eigen::Vector3d> contact_forces_;
+
+	// Start of the current real-time factor window
+	double t_sim_rtf_window_ = 0;
+	double t_host_rtf_window_ = -1;
+	double real_time_factor_ = 0;
+
+	CommandReadMode command_read_mode_ = COMMAND_READ_EVERY_STEP;
+	double command_read_freq_ = 1e3;
+
+	std::vector<std::string> keys_read_;
+	std::vector<std::string> keys_version_;
+	std::vector<std::string> command_versions_;
+	std::vector<std::string> command_versions_read_;
+	std::vector<std::pair<std::string, std::string>> keyvals_write_;
+	size_t num_keyvals_sensors_ = 0;  // Entries of keyvals_write_ written by encodeSensorValues()
+
+	std::vector<std::unique_ptr<SimulatedForceSensor>> force_sensors_;
+	std::vector<size_t> idx_force_sensor_robots_;
+	std::vector<size_t> force_sensors_due_;  // Sensors sampled this step
+	std::vector<SimulatorRate> force_sensor_rates_;
+
+	// Rates of the events in run(), scheduled in simulation time
+	SimulatorRate command_read_rate_;
+	SimulatorRate sensor_write_rate_;
+	SimulatorRate statistics_rate_;
+	std::vector<char> robots_model_needed_;  // Robots whose models the due sensors need
+
+	// Lockstep state
+	std::vector<std::string> keys_read_lockstep_;
+	size_t idx_keyvals_step_ = 0;
+	long long lockstep_step_ = 0;
+	bool lockstep_published_ = false;
+
+	// Named snapshots taken through KEY_SNAPSHOT_COMMAND
+	std::map<std::string, SimulatorSnapshot> snapshots_;
 
 };
 
@@ -0,0 +1,100 @@
+#include "simulation/StateRecorder.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void StateRecorder::open(const std::string& filename, const std::vector<int>& dofs) {
+	close();
+
+	fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd_ < 0) {
+		throw std::runtime_error("StateRecorder: could not open '" + filename + "': " + strerror(errno));
+	}
+
+	record_size_ = 1;
+	for (int dof : dofs) {
+		record_size_ += 3 * dof;
+	}
+	size_t dofs_bytes = (sizeof(uint32_t) * dofs.size() + 7) / 8 * 8;
+	try {
+		map(sizeof(Header) + dofs_bytes + kChunkBytes);
+	} catch (...) {
+		// Leave the recorder closed, so isOpen() is false
+		::close(fd_);
+		fd_ = -1;
+		throw;
+	}
+
+	// Header and robot sizes
+	header_ = reinterpret_cast<Header *>(mapping_);
+	memset(header_, 0, sizeof(Header));
+	strncpy(header_->magic, "SAISIM1", sizeof(header_->magic));
+	header_->num_robots = dofs.size();
+	header_->record_size = record_size_;
+	header_->num_records = 0;
+	header_->data_offset = sizeof(Header) + dofs_bytes;
+	uint32_t *header_dofs = reinterpret_cast<uint32_t *>(mapping_ + sizeof(Header));
+	for (size_t i = 0; i < dofs.size(); i++) {
+		header_dofs[i] = dofs[i];
+	}
+	pending_ = false;
+}
+
+void StateRecorder::map(size_t bytes) {
+	// The old mapping stays valid until the new one exists, so a failed
+	// grow keeps the records written so far
+	if (ftruncate(fd_, bytes) != 0) {
+		throw std::runtime_error(std::string("StateRecorder: could not grow log: ") + strerror(errno));
+	}
+	void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (mapping == MAP_FAILED) {
+		throw std::runtime_error(std::string("StateRecorder: could not map log: ") + strerror(errno));
+	}
+	if (mapping_) {
+		munmap(mapping_, mapping_bytes_);
+	}
+	mapping_ = static_cast<char *>(mapping);
+	mapping_bytes_ = bytes;
+	header_ = reinterpret_cast<Header *>(mapping_);
+}
+
+double *StateRecorder::append() {
+	if (pending_) {
+		++header_->num_records;
+		pending_ = false;
+	}
+
+	size_t offset = header_->data_offset + sizeof(double) * record_size_ * header_->num_records;
+	if (offset + sizeof(double) * record_size_ > mapping_bytes_) {
+		map(mapping_bytes_ + kChunkBytes);
+	}
+	pending_ = true;
+	return reinterpret_cast<double *>(mapping_ + offset);
+}
+
+void StateRecorder::close() {
+	if (fd_ < 0) return;
+
+	size_t bytes = mapping_bytes_;
+	if (header_) {
+		if (pending_) ++header_->num_records;
+		bytes = header_->data_offset + sizeof(double) * record_size_ * header_->num_records;
+	}
+	if (mapping_) {
+		munmap(mapping_, mapping_bytes_);
+	}
+	if (ftruncate(fd_, bytes) != 0) {
+		// Keep the preallocated tail, num_records in the header is still valid
+	}
+	::close(fd_);
+
+	fd_ = -1;
+	mapping_ = nullptr;
+	mapping_bytes_ = 0;
+	header_ = nullptr;
+	pending_ = false;
+}
@@ -0,0 +1,89 @@
+#ifndef CS225A_STATE_RECORDER_H
+#define CS225A_STATE_RECORDER_H
+
+// Standard
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Append-only binary log of simulator states in a memory-mapped file.
+ *
+ * Appending a record is a memcpy into the mapping, so recording at the full
+ * integration rate costs no system calls except when the file grows (every
+ * kChunkBytes).
+ *
+ * File layout (native endianness):
+ *   Header                      64 bytes, see below
+ *   uint32_t dof[num_robots]    padded to a multiple of 8 bytes
+ *   double record[num_records][record_size]
+ *
+ * Each record is [t_sim, q_0, dq_0, tau_0, q_1, dq_1, tau_1, ...] with
+ * q_i, dq_i and tau_i of length dof[i]. In numpy:
+ *   header = np.fromfile(f, dtype=np.uint64, count=8)  # [magic, num_robots, record_size, num_records, data_offset, ...]
+ *   records = np.memmap(f, dtype=np.float64, offset=header[4]).reshape(-1, header[2])
+ */
+class StateRecorder {
+
+public:
+
+	struct Header {
+		char magic[8];            // "SAISIM1"
+		uint64_t num_robots;
+		uint64_t record_size;     // Doubles per record
+		uint64_t num_records;     // Updated with every record
+		uint64_t data_offset;     // Bytes from the start of the file to the first record
+		uint64_t reserved[3];
+	};
+
+	StateRecorder() {}
+	~StateRecorder() { close(); }
+
+	StateRecorder(const StateRecorder&) = delete;
+	StateRecorder& operator=(const StateRecorder&) = delete;
+
+	/**
+	 * Create the log file. Throws std::runtime_error on failure.
+	 *
+	 * @param filename  Log file, overwritten if it exists.
+	 * @param dofs      Degrees of freedom of every recorded robot.
+	 */
+	void open(const std::string& filename, const std::vector<int>& dofs);
+
+	/**
+	 * Truncate the file to the recorded size and unmap it.
+	 */
+	void close();
+
+	bool isOpen() const { return fd_ >= 0; }
+
+	/**
+	 * Doubles per record.
+	 */
+	size_t recordSize() const { return record_size_; }
+
+	uint64_t numRecords() const { return header_ ? header_->num_records : 0; }
+
+	/**
+	 * Slot for the next record, to be filled with recordSize() doubles.
+	 * The record counts as written from the next call on, or on close().
+	 */
+	double *append();
+
+protected:
+
+	static const size_t kChunkBytes = 64 << 20;
+
+	// Map the file with at least bytes capacity
+	void map(size_t bytes);
+
+	int fd_ = -1;
+	char *mapping_ = nullptr;
+	size_t mapping_bytes_ = 0;
+	size_t record_size_ = 0;
+	Header *header_ = nullptr;
+	bool pending_ = false;  // append() handed out a slot not yet counted
+
+};
+
+#endif  // CS225A_STATE_RECORDER_H
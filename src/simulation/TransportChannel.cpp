@@ -0,0 +1,121 @@
+#include "simulation/TransportChannel.h"
+
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+TransportChannel::TransportChannel(int dimension) :
+	uniform_(0.0, 1.0),
+	t_output_sent_(-std::numeric_limits<double>::infinity()),
+	t_last_sample_(-std::numeric_limits<double>::infinity())
+{
+	if (dimension > 0) output_ = Eigen::VectorXd::Zero(dimension);
+}
+
+void TransportChannel::setConfig(const Config& config, unsigned int seed) {
+	config_ = config;
+	seed_ = seed;
+	rng_.seed(seed);
+}
+
+bool TransportChannel::enabled() const {
+	return config_.delay > 0 || config_.jitter > 0 || config_.drop_probability > 0 || config_.hold_period > 0;
+}
+
+void TransportChannel::send(double t, const Eigen::VectorXd& value) {
+	// Nothing received yet: start from the first value
+	if (output_.size() == 0) output_ = value;
+
+	if (!enabled()) {
+		output_ = value;
+		t_output_sent_ = t;
+		++num_sent_;
+		return;
+	}
+
+	// Sample-and-hold at a slower rate (with a margin for floating point sim times)
+	if (t - t_last_sample_ < config_.hold_period - 1e-9) {
+		++num_held_;
+		return;
+	}
+	t_last_sample_ = t;
+
+	++num_sent_;
+	if (config_.drop_probability > 0 && uniform_(rng_) < config_.drop_probability) {
+		++num_dropped_;
+		return;
+	}
+
+	double t_arrival = t + config_.delay + config_.jitter * uniform_(rng_);
+	in_flight_.push_back({t, t_arrival, value});
+}
+
+const Eigen::VectorXd& TransportChannel::receive(double t) {
+	if (!enabled()) return output_;
+
+	// Deliver arrived values, keeping the newest one
+	for (size_t i = 0; i < in_flight_.size(); ) {
+		Packet& packet = in_flight_[i];
+		if (packet.t_arrival > t) {
+			i++;
+			continue;
+		}
+		if (packet.t_sent > t_output_sent_) {
+			output_.swap(packet.value);
+			t_output_sent_ = packet.t_sent;
+			latency_.record(static_cast<int64_t>(1e9 * (packet.t_arrival - packet.t_sent)));
+		} else {
+			++num_stale_;
+		}
+		in_flight_[i] = std::move(in_flight_.back());
+		in_flight_.pop_back();
+	}
+
+	if (t_output_sent_ > -std::numeric_limits<double>::infinity()) {
+		age_.record(static_cast<int64_t>(1e9 * (t - t_output_sent_)));
+	}
+	return output_;
+}
+
+void TransportChannel::reset(const Eigen::VectorXd& value) {
+	in_flight_.clear();
+	output_ = value;
+	t_output_sent_ = -std::numeric_limits<double>::infinity();
+	t_last_sample_ = -std::numeric_limits<double>::infinity();
+	rng_.seed(seed_);
+	uniform_.reset();
+}
+
+void TransportChannel::resetStatistics() {
+	num_sent_ = 0;
+	num_dropped_ = 0;
+	num_held_ = 0;
+	num_stale_ = 0;
+	latency_.reset();
+	age_.reset();
+}
+
+void TransportChannel::printStatistics(std::ostream& os) const {
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2)
+	   << "sent " << num_sent_
+	   << " dropped " << num_dropped_
+	   << " (" << (num_sent_ ? 100.0 * num_dropped_ / num_sent_ : 0.0) << "%)"
+	   << " held " << num_held_
+	   << " stale " << num_stale_
+	   << " | latency [ms] p50 " << 1e3 * latency_.percentile(0.5)
+	   << " p99 " << 1e3 * latency_.percentile(0.99)
+	   << " max " << 1e3 * latency_.max()
+	   << " | age [ms] p50 " << 1e3 * age_.percentile(0.5)
+	   << " p99 " << 1e3 * age_.percentile(0.99)
+	   << " max " << 1e3 * age_.max();
+	os.flags(flags);
+	os.precision(precision);
+}
+
+std::string TransportChannel::statistics() const {
+	std::stringstream ss;
+	printStatistics(ss);
+	return ss.str();
+}
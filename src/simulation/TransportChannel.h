@@ -0,0 +1,102 @@
+#ifndef CS225A_TRANSPORT_CHANNEL_H
+#define CS225A_TRANSPORT_CHANNEL_H
+
+#include "timer/LoopStatistics.h"
+
+// Standard
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// External
+#include <Eigen/Core>
+
+/**
+ * Simulated transport of a signal between processes, in simulation time.
+ *
+ * Values sent at time t arrive after a fixed delay plus random jitter, may
+ * be dropped, and the receiver holds the newest value that has arrived.
+ * Values overtaken by newer ones (through jitter) are discarded. With a
+ * hold period the sender only samples every hold_period seconds, like a
+ * slower link with sample-and-hold. Without any impairment configured the
+ * channel passes values straight through.
+ *
+ * Statistics keep the latency of delivered values and the age of the value
+ * the receiver uses, which is what matters for the stability of a loop
+ * closed over the channel.
+ */
+class TransportChannel {
+
+public:
+
+	struct Config {
+		double delay = 0;             // Fixed latency [s]
+		double jitter = 0;            // Additional latency, uniform in [0, jitter] [s]
+		double drop_probability = 0;  // Probability that a sent value is lost
+		double hold_period = 0;       // Sample at most every hold_period [s], 0 = every send
+	};
+
+	/**
+	 * @param dimension  Size of the value received before anything arrives
+	 *                   (zeros). 0 uses the first value sent.
+	 */
+	explicit TransportChannel(int dimension = 0);
+
+	void setConfig(const Config& config, unsigned int seed = 0);
+	const Config& config() const { return config_; }
+
+	// Any impairment configured
+	bool enabled() const;
+
+	// Send a value at simulation time t
+	void send(double t, const Eigen::VectorXd& value);
+
+	// Newest value that has arrived by simulation time t
+	const Eigen::VectorXd& receive(double t);
+
+	// Discard values in flight and receive value until the next arrival, e.g.
+	// after the simulation time jumped back. An empty value uses the next one sent.
+	// Reseeds the jitter and drop generator, so the same values arrive again.
+	void reset(const Eigen::VectorXd& value);
+
+	/***** Statistics *****/
+
+	uint64_t numSent() const { return num_sent_; }
+	uint64_t numDropped() const { return num_dropped_; }
+
+	void resetStatistics();
+
+	// One-line summary of counts, latency and age in milliseconds
+	void printStatistics(std::ostream& os) const;
+	std::string statistics() const;
+
+protected:
+
+	struct Packet {
+		double t_sent;
+		double t_arrival;
+		Eigen::VectorXd value;
+	};
+
+	Config config_;
+	unsigned int seed_ = 0;
+	std::mt19937 rng_;
+	std::uniform_real_distribution<double> uniform_;
+
+	std::vector<Packet> in_flight_;
+	Eigen::VectorXd output_;
+	double t_output_sent_;  // Send time of output_
+	double t_last_sample_;  // Last time the sender sampled (hold period)
+
+	uint64_t num_sent_ = 0;
+	uint64_t num_dropped_ = 0;
+	uint64_t num_held_ = 0;   // Sends skipped by the hold period
+	uint64_t num_stale_ = 0;  // Arrived after a newer value
+	LoopHistogram latency_;   // Arrival - send time of delivered values
+	LoopHistogram age_;       // Receive time - send time of the value in use
+
+};
+
+#endif  // CS225A_TRANSPORT_CHANNEL_H
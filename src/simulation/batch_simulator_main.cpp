@@ -0,0 +1,138 @@
+// Steps N independent copies of a world in lockstep with their controllers
+// on a thread pool, e.g. to run many controller trials in parallel. World i
+// publishes and reads its keys under cs225a::world<i>::<robot-name>::
+
+#include "simulation/Simulator.h"
+#include "concurrency/WorkerPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <signal.h>
+
+int main(int argc, char** argv) {
+	// Parse options
+	int num_worlds = 1;
+	unsigned int num_threads = 0;
+	double duration = 0;
+	std::string force_sensor_robot, force_sensor_link;
+	bool adaptive = false;
+	Simulator::AdaptiveStepping adaptive_stepping;
+	std::vector<std::pair<std::string, std::string>> contact_links;
+	std::vector<char *> args;
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--worlds") && i + 1 < argc) {
+			num_worlds = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			num_threads = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			duration = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor") && i + 2 < argc) {
+			force_sensor_robot = argv[++i];
+			force_sensor_link = argv[++i];
+		} else if (!strcmp(argv[i], "--adaptive") && i + 2 < argc) {
+			adaptive = true;
+			adaptive_stepping.min_substeps = std::stoi(argv[++i]);
+			adaptive_stepping.max_substeps = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--contact-link") && i + 2 < argc) {
+			contact_links.emplace_back(argv[i+1], argv[i+2]);
+			i += 2;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+
+	// Parse command line
+	if (args.size() < 4 || args.size() % 2 != 0 || num_worlds < 1) {
+		std::cout << "Usage: batch_simulator [options] <path-to-world.urdf> <path-to-robot-1.urdf> <robot-name-1> ..." << std::endl
+		          << "  --worlds N        Number of world copies (default 1)." << std::endl
+		          << "  --threads T       Worker threads (default one per hardware thread)." << std::endl
+		          << "  --duration SEC    Stop each world after SEC seconds of simulation time (default: run until ctrl-c)." << std::endl
+		          << "  --force-sensor ROBOT LINK" << std::endl
+		          << "                    Simulate the 6-axis Optoforce on LINK, on cs225a::world<i>::optoforce_6d::force." << std::endl
+		          << "  --adaptive MIN MAX          Adaptive substeps per control period (see simulator)." << std::endl
+		          << "  --contact-link ROBOT LINK   Watch LINK for contact with --adaptive (repeatable)." << std::endl
+		          << std::endl
+		          << "World i uses the keys cs225a::world<i>::<robot-name>::... Every world runs in lockstep" << std::endl
+		          << "with its controllers (see simulator --lockstep)." << std::endl;
+		exit(0);
+	}
+
+	// Argument 1: <path-to-world.urdf>
+	std::string world_file(args[1]);
+
+	// Set up signal handler
+	signal(SIGABRT, &Simulator::stop);
+	signal(SIGTERM, &Simulator::stop);
+	signal(SIGINT, &Simulator::stop);
+
+	// Load independent copies of the world and robot models
+	std::vector<std::unique_ptr<Simulator>> worlds;
+	for (int w = 0; w < num_worlds; w++) {
+		std::vector<std::string> robot_names;
+		std::vector<std::shared_ptr<Model::ModelInterface>> robots;
+		for (size_t i = 2; i < args.size(); i += 2) {
+			robots.push_back(std::make_shared<Model::ModelInterface>(std::string(args[i]), Model::rbdl, Model::urdf, false));
+			robot_names.emplace_back(args[i+1]);
+		}
+		auto sim = std::make_shared<Simulation::SimulationInterface>(world_file, Simulation::sai2simulation, Simulation::urdf, false);
+
+		std::string key_prefix = "cs225a::world" + std::to_string(w) + "::";
+		worlds.emplace_back(new Simulator(sim, robots, robot_names, key_prefix));
+		if (!force_sensor_robot.empty()) {
+			worlds.back()->addForceSensor(force_sensor_robot, force_sensor_link, key_prefix + "optoforce_6d::force");
+		}
+		if (adaptive) {
+			worlds.back()->setAdaptiveStepping(adaptive_stepping);
+			for (const auto& link : contact_links) {
+				worlds.back()->addContactLink(link.first, link.second);
+			}
+		}
+		worlds.back()->initialize();
+		worlds.back()->initializeLockstep();
+	}
+
+	WorkerPool pool(num_threads);
+	std::cout << "Stepping " << num_worlds << " worlds on " << pool.size() << " threads. "
+	          << "Waiting for controllers on cs225a::world<i>::" << args[3] << "::sim::step." << std::endl;
+
+	// Each round, every unfinished world publishes its step or checks for acknowledgements once
+	auto t_start = std::chrono::steady_clock::now();
+	bool finished = false;
+	while (Simulator::running() && !finished) {
+		std::atomic<size_t> num_stepped(0);
+		pool.parallelFor(worlds.size(), [&](size_t w) {
+			if (duration > 0 && worlds[w]->lockstepTime() >= duration) return;
+			if (worlds[w]->stepLockstep()) ++num_stepped;
+		});
+
+		// Back off while every controller is still computing
+		if (num_stepped == 0) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(worlds[0]->kLockstepPollPeriod));
+		}
+
+		finished = duration > 0;
+		for (auto& world : worlds) {
+			if (world->lockstepTime() < duration) finished = false;
+		}
+	}
+	double t_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+	// Report
+	double t_sim_total = 0;
+	for (size_t w = 0; w < worlds.size(); w++) {
+		std::cout << "World " << w << " : " << worlds[w]->lockstepStep() << " steps, "
+		          << worlds[w]->lockstepTime() << " seconds" << std::endl;
+		worlds[w]->printSubstepStatistics();
+		t_sim_total += worlds[w]->lockstepTime();
+		worlds[w]->cleanup();
+	}
+	std::cout << "Wall time                  : " << t_wall << " seconds" << std::endl
+	          << "Aggregate real-time factor : " << (t_wall > 0 ? t_sim_total / t_wall : 0) << std::endl;
+
+	return 0;
+}
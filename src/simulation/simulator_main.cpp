@@ -0,0 +1,181 @@
+#include "simulation/Simulator.h"
+#include "optoforce/Optoforce.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <signal.h>
+
+int main(int argc, char** argv) {
+	// Parse options
+	bool lockstep = false;
+	Simulator::CommandReadMode command_read_mode = Simulator::COMMAND_READ_EVERY_STEP;
+	double command_read_freq = 1e3;
+	unsigned int num_threads = 1;
+	std::string record_file;
+	unsigned int record_every = 1;
+	double headless_duration = 0;
+	std::string force_sensor_robot, force_sensor_link;
+	double force_sensor_rate = 1e3;
+	double force_sensor_noise_force = 0, force_sensor_noise_moment = 0;
+	Eigen::VectorXd force_sensor_bias = Eigen::VectorXd::Zero(6);
+	double force_sensor_cutoff = 0.05;
+	double force_sensor_latency = 0;
+	TransportChannel::Config command_transport, sensor_transport;
+	unsigned int transport_seed = 0;
+	bool adaptive = false;
+	Simulator::AdaptiveStepping adaptive_stepping;
+	std::vector<std::pair<std::string, std::string>> contact_links;
+	std::vector<char *> args;
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--lockstep")) {
+			lockstep = true;
+		} else if (!strcmp(argv[i], "--command-rate") && i + 1 < argc) {
+			command_read_mode = Simulator::COMMAND_READ_CONTROL_RATE;
+			command_read_freq = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--command-version")) {
+			command_read_mode = Simulator::COMMAND_READ_ON_VERSION;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			num_threads = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+			record_file = argv[++i];
+		} else if (!strcmp(argv[i], "--record-every") && i + 1 < argc) {
+			record_every = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+			headless_duration = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor") && i + 2 < argc) {
+			force_sensor_robot = argv[++i];
+			force_sensor_link = argv[++i];
+		} else if (!strcmp(argv[i], "--force-sensor-rate") && i + 1 < argc) {
+			force_sensor_rate = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor-noise") && i + 2 < argc) {
+			force_sensor_noise_force = std::stod(argv[++i]);
+			force_sensor_noise_moment = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor-bias") && i + 6 < argc) {
+			for (int j = 0; j < 6; j++) force_sensor_bias(j) = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor-cutoff") && i + 1 < argc) {
+			force_sensor_cutoff = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--force-sensor-latency") && i + 1 < argc) {
+			force_sensor_latency = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--command-delay") && i + 1 < argc) {
+			command_transport.delay = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--command-jitter") && i + 1 < argc) {
+			command_transport.jitter = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--command-drop") && i + 1 < argc) {
+			command_transport.drop_probability = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--command-hold") && i + 1 < argc) {
+			command_transport.hold_period = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--sensor-delay") && i + 1 < argc) {
+			sensor_transport.delay = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--sensor-jitter") && i + 1 < argc) {
+			sensor_transport.jitter = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--sensor-drop") && i + 1 < argc) {
+			sensor_transport.drop_probability = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--sensor-hold") && i + 1 < argc) {
+			sensor_transport.hold_period = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--transport-seed") && i + 1 < argc) {
+			transport_seed = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--adaptive") && i + 2 < argc) {
+			adaptive = true;
+			adaptive_stepping.min_substeps = std::stoi(argv[++i]);
+			adaptive_stepping.max_substeps = std::stoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--adaptive-joint-step") && i + 1 < argc) {
+			adaptive_stepping.max_joint_step = std::stod(argv[++i]);
+		} else if (!strcmp(argv[i], "--contact-link") && i + 2 < argc) {
+			contact_links.emplace_back(argv[i+1], argv[i+2]);
+			i += 2;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+
+	// Parse command line
+	if (args.size() < 4 || args.size() % 2 != 0) {
+		std::cout << "Usage: simulator [options] <path-to-world.urdf> <path-to-robot-1.urdf> <robot-name-1> ..." << std::endl
+		          << "  --lockstep             Integrate each control period only after the controllers acknowledge it." << std::endl
+		          << "  --command-rate HZ      Read command torques at HZ and hold them in between." << std::endl
+		          << "  --command-version      Read command torques only when <robot>::actuators::fgc_version changes," << std::endl
+		          << "                         checked at 1 kHz. The controller must write it after its torques" << std::endl
+		          << "                         (demo_project, kuka_hold_pos and screwCapTask do)." << std::endl
+		          << "  --threads T            Decode, encode and update robot models on T threads, at most one per robot" << std::endl
+		          << "                         (default 1). Idle threads spin between steps." << std::endl
+		          << "  --record FILE          Record q, dq, torques and sim time to a binary log (see StateRecorder.h)." << std::endl
+		          << "  --record-every N       Record every Nth integration step (default 1)." << std::endl
+		          << "  --headless SEC         Integrate SEC seconds as fast as possible without Redis, with zero torques." << std::endl
+		          << "  --force-sensor ROBOT LINK" << std::endl
+		          << "                         Simulate the 6-axis Optoforce on LINK, published on " << Optoforce::KEY_6D_SENSOR_FORCE << "." << std::endl
+		          << "  --force-sensor-rate HZ           Sample rate (default 1000)." << std::endl
+		          << "  --force-sensor-noise SF SM       Noise standard deviation of forces [N] and moments [Nm] (default 0)." << std::endl
+		          << "  --force-sensor-bias FX FY FZ MX MY MZ   Constant offset (default 0)." << std::endl
+		          << "  --force-sensor-cutoff FC         Filter cutoff as a fraction of the sample rate, 0 = off (default 0.05)." << std::endl
+		          << "  --force-sensor-latency SEC       Delay between sampling and publishing, on top of --sensor-delay (default 0)." << std::endl
+		          << "  --command-delay SEC    Delay command torques by SEC of sim time." << std::endl
+		          << "  --command-jitter SEC   Add a random delay in [0, SEC] to every command." << std::endl
+		          << "  --command-drop P       Drop commands with probability P." << std::endl
+		          << "  --command-hold SEC     Take a new command at most every SEC and hold it in between." << std::endl
+		          << "  --sensor-delay SEC, --sensor-jitter SEC, --sensor-drop P, --sensor-hold SEC" << std::endl
+		          << "                         The same for published joint states and force sensors." << std::endl
+		          << "  --transport-seed N     Seed of the jitter and drop generators (default 0)." << std::endl
+		          << "  --adaptive MIN MAX     Integrate each 1 ms control period in MIN substeps in free space and" << std::endl
+		          << "                         MAX in contact (fixed: 10). Force sensor links are watched for contact." << std::endl
+		          << "  --adaptive-joint-step RAD      Limit joint motion per substep in free space (default 0.002)." << std::endl
+		          << "  --contact-link ROBOT LINK      Also watch LINK for contact (repeatable)." << std::endl;
+		exit(0);
+	}
+
+	// Argument 0: executable name
+	// Argument 1: <path-to-world.urdf>
+	std::string world_file(args[1]);
+
+	// Load robots
+	std::vector<std::string> robot_names;
+	std::vector<std::shared_ptr<Model::ModelInterface>> robots;
+	for (size_t i = 2; i < args.size(); i += 2) {
+		// Argument 2: <path-to-robot.urdf>
+		robots.push_back(std::make_shared<Model::ModelInterface>(std::string(args[i]), Model::rbdl, Model::urdf, false));
+		// Argument 3: <robot-name>
+		robot_names.emplace_back(args[i+1]);
+	}
+
+	// Set up signal handler
+	signal(SIGABRT, &Simulator::stop);
+	signal(SIGTERM, &Simulator::stop);
+	signal(SIGINT, &Simulator::stop);
+
+	// Load simulation world
+	auto sim = std::make_shared<Simulation::SimulationInterface>(world_file, Simulation::sai2simulation, Simulation::urdf, false);
+
+	Simulator app(sim, robots, robot_names);
+	app.setCommandReadMode(command_read_mode, command_read_freq);
+	app.setNumThreads(num_threads);
+	if (!force_sensor_robot.empty()) {
+		auto& sensor = app.addForceSensor(force_sensor_robot, force_sensor_link, Optoforce::KEY_6D_SENSOR_FORCE);
+		sensor.setSampleRate(force_sensor_rate);
+		sensor.setNoise(force_sensor_noise_force, force_sensor_noise_moment);
+		sensor.setBias(force_sensor_bias);
+		sensor.setFilterCutoff(force_sensor_cutoff);
+		sensor.setTransport(sensor_transport, transport_seed + 2 * robots.size());
+		sensor.setLatency(force_sensor_latency);
+	}
+	app.setTransport(command_transport, sensor_transport, transport_seed);
+	if (adaptive) {
+		app.setAdaptiveStepping(adaptive_stepping);
+		for (const auto& link : contact_links) {
+			app.addContactLink(link.first, link.second);
+		}
+	}
+	if (!record_file.empty()) {
+		app.setRecording(record_file, record_every);
+	}
+	if (headless_duration > 0) {
+		app.runHeadless(headless_duration);
+		return 0;
+	}
+	app.initialize();
+	if (lockstep) {
+		app.runLockstep();
+	} else {
+		app.run();
+	}
+	app.cleanup();
+}
@@ -0,0 +1,44 @@
+#include "LoopClock.h"
+
+int64_t SimulationClock::now() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return ns_time_;
+}
+
+void SimulationClock::sleepUntil(int64_t ns_target) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	cv_.wait(lock, [this, ns_target]() { return stopped_ || ns_time_ >= ns_target; });
+}
+
+void SimulationClock::advance(double seconds) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		ns_time_ += static_cast<int64_t>(1e9 * seconds + 0.5);
+	}
+	cv_.notify_all();
+}
+
+void SimulationClock::setTime(double seconds) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		int64_t ns_time = static_cast<int64_t>(1e9 * seconds + 0.5);
+		if (ns_time > ns_time_) ns_time_ = ns_time;
+	}
+	cv_.notify_all();
+}
+
+void SimulationClock::reset(double seconds) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		ns_time_ = static_cast<int64_t>(1e9 * seconds + 0.5);
+	}
+	cv_.notify_all();
+}
+
+void SimulationClock::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopped_ = true;
+	}
+	cv_.notify_all();
+}
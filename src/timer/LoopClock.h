@@ -0,0 +1,69 @@
+//LoopClock.h
+
+#ifndef SAI_LOOPCLOCK_H_
+#define SAI_LOOPCLOCK_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/** \brief Time source for LoopTimer.
+ *
+ * By default LoopTimer follows the host's monotonic clock. Give it a
+ * LoopClock with LoopTimer::setClock() to run it against another time base.
+ */
+class LoopClock {
+
+public:
+
+	virtual ~LoopClock() {}
+
+	/** \brief Current time in nanoseconds. */
+	virtual int64_t now() = 0;
+
+	/** \brief Block until now() >= ns_target. */
+	virtual void sleepUntil(int64_t ns_target) = 0;
+
+};
+
+/** \brief Clock that only moves when advanced externally, e.g. by a simulator.
+ *
+ * A LoopTimer on this clock wakes up as soon as the simulation time reaches
+ * the next tick, so a loop runs in lockstep with the simulation at whatever
+ * speed it is advanced. Thread safe.
+ */
+class SimulationClock : public LoopClock {
+
+public:
+
+	/** \brief Simulation time in nanoseconds. */
+	virtual int64_t now();
+
+	/** \brief Block until the simulation time reaches ns_target, or stop() is called. */
+	virtual void sleepUntil(int64_t ns_target);
+
+	/** \brief Advance the simulation time and wake up waiting timers. */
+	void advance(double seconds);
+
+	/** \brief Set the simulation time and wake up waiting timers. Time never moves backwards. */
+	void setTime(double seconds);
+
+	/** \brief Set the simulation time, also backwards, e.g. after the simulator restored a snapshot. */
+	void reset(double seconds);
+
+	/** \brief Simulation time in seconds. */
+	double time() { return 1e-9 * now(); }
+
+	/** \brief Release all waiting timers for good, e.g. on shutdown. */
+	void stop();
+
+protected:
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	int64_t ns_time_ = 0;
+	bool stopped_ = false;
+
+};
+
+#endif /* SAI_LOOPCLOCK_H_ */
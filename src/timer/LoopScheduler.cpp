@@ -0,0 +1,60 @@
+#include "LoopScheduler.h"
+
+#include <chrono>
+
+void LoopScheduler::setBaseFrequency(double frequency) {
+	timer_.setLoopFrequency(frequency);
+	ns_base_interval_ = static_cast<int64_t>(1e9 / frequency);
+}
+
+int LoopScheduler::addTask(const std::string& name, std::function<void(void)> task,
+                           unsigned int divisor, unsigned int phase) {
+	if (divisor == 0) divisor = 1;
+	Task t;
+	t.name = name;
+	t.function = task;
+	t.divisor = divisor;
+	t.phase = phase % divisor;
+	tasks_.push_back(t);
+	return tasks_.size() - 1;
+}
+
+void LoopScheduler::run(unsigned int initial_wait_nanoseconds) {
+	typedef std::chrono::steady_clock Clock;
+
+	timer_.initializeTimer(initial_wait_nanoseconds);
+	running_ = true;
+	while (running_) {
+		timer_.waitForNextLoop();
+		auto t_tick = Clock::now();
+
+		for (auto& task : tasks_) {
+			if (tick_ % task.divisor != task.phase) continue;
+
+			auto t_start = Clock::now();
+			task.function();
+			auto t_end = Clock::now();
+
+			int64_t ns_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start).count();
+			task.stats.start.record(std::chrono::duration_cast<std::chrono::nanoseconds>(t_start - t_tick).count());
+			task.stats.duration.record(ns_duration);
+			if (ns_duration > task.divisor * ns_base_interval_) ++task.stats.overruns;
+		}
+
+		++tick_;
+	}
+}
+
+void LoopScheduler::printStatistics(std::ostream& os) const {
+	os << "Base tick : " << timer_.statistics().toString() << std::endl;
+	for (const auto& task : tasks_) {
+		const TaskStatistics& stats = task.stats;
+		os << "Task " << task.name << " (1/" << task.divisor << ")"
+		   << " : duration [us] p50 " << 1e6 * stats.duration.percentile(0.5)
+		   << " p99 " << 1e6 * stats.duration.percentile(0.99)
+		   << " p99.9 " << 1e6 * stats.duration.percentile(0.999)
+		   << " max " << 1e6 * stats.duration.max()
+		   << " | start [us] p99 " << 1e6 * stats.start.percentile(0.99)
+		   << " | overruns " << stats.overruns << "/" << stats.duration.count() << std::endl;
+	}
+}
@@ -0,0 +1,95 @@
+//LoopScheduler.h
+
+#ifndef SAI_LOOPSCHEDULER_H_
+#define SAI_LOOPSCHEDULER_H_
+
+#include "LoopTimer.h"
+#include "LoopStatistics.h"
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/** \brief Run several periodic tasks at integer divisors of a base rate on one timed thread.
+ *
+ * A task with divisor d and phase p runs on every base tick k where
+ * k % d == p. Tasks due on the same tick run in the order they were added.
+ *
+ * Example: 10 kHz integration with a 1 kHz sensor write.
+ *
+ *   LoopScheduler scheduler;
+ *   scheduler.setBaseFrequency(1e4);
+ *   scheduler.addTask("integrate", integrate);
+ *   scheduler.addTask("sensor_write", writeSensors, 10);
+ *   scheduler.run();
+ */
+class LoopScheduler {
+
+public:
+
+	/** \brief Timing statistics of one task. */
+	struct TaskStatistics {
+		LoopHistogram start;     // Task start time relative to the tick wake-up
+		LoopHistogram duration;  // Task execution time
+		uint64_t overruns = 0;   // Executions longer than the task period
+
+		void reset() {
+			start.reset();
+			duration.reset();
+			overruns = 0;
+		}
+	};
+
+	/** \brief Set the base tick frequency. Call before run(). */
+	void setBaseFrequency(double frequency);
+
+	/** \brief Register a periodic task.
+	 * \param name Name used when printing statistics.
+	 * \param task Function to call.
+	 * \param divisor Run every divisor base ticks (task rate = base rate / divisor).
+	 * \param phase Base tick offset in [0, divisor) of the first execution.
+	 * \return Task id, for taskStatistics().
+	 */
+	int addTask(const std::string& name, std::function<void(void)> task,
+	            unsigned int divisor = 1, unsigned int phase = 0);
+
+	/** \brief Run the tasks until stop() is called. Blocking function.
+	 * \param initial_wait_nanoseconds The delay before the first tick.
+	 */
+	void run(unsigned int initial_wait_nanoseconds = 0);
+
+	/** \brief Stop the loop started by run(). Use within a task, or from a separate thread. */
+	void stop() { running_ = false; }
+
+	/** \brief Number of base ticks run so far. */
+	unsigned long long elapsedTicks() const { return tick_; }
+
+	/** \brief Timing statistics of a task. */
+	const TaskStatistics& taskStatistics(int id) const { return tasks_[id].stats; }
+
+	/** \brief Print base tick and per-task statistics. */
+	void printStatistics(std::ostream& os = std::cout) const;
+
+	/** \brief Underlying timer, e.g. to select wait backend and overrun policy. */
+	LoopTimer& timer() { return timer_; }
+
+protected:
+
+	struct Task {
+		std::string name;
+		std::function<void(void)> function;
+		unsigned int divisor;
+		unsigned int phase;
+		TaskStatistics stats;
+	};
+
+	LoopTimer timer_;
+	std::vector<Task> tasks_;
+	int64_t ns_base_interval_ = 1000000;
+	unsigned long long tick_ = 0;
+	volatile bool running_ = false;
+
+};
+
+#endif /* SAI_LOOPSCHEDULER_H_ */
@@ -0,0 +1,77 @@
+#include "LoopStatistics.h"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+int LoopHistogram::bucketIndex(uint64_t nanoseconds) {
+	if (nanoseconds < 2 * kSubBuckets) return static_cast<int>(nanoseconds);
+
+	// Index of most significant bit determines the power-of-two range
+	int msb = 63 - __builtin_clzll(nanoseconds);
+	int shift = msb - kSubBucketBits;
+	int index = shift * kSubBuckets + static_cast<int>(nanoseconds >> shift);
+	return index < kNumBuckets ? index : kNumBuckets - 1;
+}
+
+uint64_t LoopHistogram::bucketUpperBound(int index) {
+	if (index < 2 * kSubBuckets) return index;
+	int shift = index / kSubBuckets - 1;
+	uint64_t mantissa = index % kSubBuckets + kSubBuckets;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void LoopHistogram::record(int64_t nanoseconds) {
+	uint64_t ns = nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0;
+	++buckets_[bucketIndex(ns)];
+	++count_;
+	sum_ += ns;
+	if (ns > max_) max_ = ns;
+}
+
+void LoopHistogram::reset() {
+	memset(buckets_, 0, sizeof(buckets_));
+	count_ = 0;
+	max_ = 0;
+	sum_ = 0.0;
+}
+
+double LoopHistogram::percentile(double p) const {
+	if (count_ == 0) return 0.0;
+
+	// Walk buckets until the requested rank is reached
+	uint64_t rank = static_cast<uint64_t>(p * count_);
+	if (rank >= count_) rank = count_ - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < kNumBuckets; i++) {
+		seen += buckets_[i];
+		if (seen > rank) {
+			uint64_t upper = bucketUpperBound(i);
+			return 1e-9 * (upper < max_ ? upper : max_);
+		}
+	}
+	return max();
+}
+
+void LoopStatistics::print(std::ostream& os) const {
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(1)
+	   << "lateness [us] p50 " << 1e6 * lateness.percentile(0.5)
+	   << " p99 " << 1e6 * lateness.percentile(0.99)
+	   << " p99.9 " << 1e6 * lateness.percentile(0.999)
+	   << " max " << 1e6 * lateness.max()
+	   << " | cycle [us] p50 " << 1e6 * cycle.percentile(0.5)
+	   << " p99 " << 1e6 * cycle.percentile(0.99)
+	   << " p99.9 " << 1e6 * cycle.percentile(0.999)
+	   << " max " << 1e6 * cycle.max()
+	   << " | overruns " << overruns << "/" << lateness.count();
+	os.flags(flags);
+	os.precision(precision);
+}
+
+std::string LoopStatistics::toString() const {
+	std::stringstream ss;
+	print(ss);
+	return ss.str();
+}
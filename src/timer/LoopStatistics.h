@@ -0,0 +1,82 @@
+//LoopStatistics.h
+
+#ifndef SAI_LOOPSTATISTICS_H_
+#define SAI_LOOPSTATISTICS_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/** \brief Fixed-memory histogram of durations in nanoseconds.
+ *
+ * Log-linear buckets: values below 64 ns get their own bucket, and every
+ * power of two above is split into 32 sub-buckets, so percentiles are within
+ * ~3% of the true value. Recording never allocates.
+ */
+class LoopHistogram {
+
+public:
+
+	LoopHistogram() { reset(); }
+
+	/** \brief Record a duration. Negative durations are recorded as zero. */
+	void record(int64_t nanoseconds);
+
+	/** \brief Clear all recorded samples. */
+	void reset();
+
+	/** \brief Number of recorded samples. */
+	uint64_t count() const { return count_; }
+
+	/** \brief Duration below which the fraction p in [0,1] of samples fall, in seconds. */
+	double percentile(double p) const;
+
+	/** \brief Largest recorded duration in seconds. */
+	double max() const { return 1e-9 * max_; }
+
+	/** \brief Mean of recorded durations in seconds. */
+	double mean() const { return count_ ? 1e-9 * sum_ / count_ : 0.0; }
+
+protected:
+
+	static const int kSubBucketBits = 5;
+	static const int kSubBuckets = 1 << kSubBucketBits;
+	static const int kNumBuckets = 2 * kSubBuckets + 36 * kSubBuckets;  // Up to ~2^41 ns
+
+	static int bucketIndex(uint64_t nanoseconds);
+	static uint64_t bucketUpperBound(int index);
+
+	uint64_t buckets_[kNumBuckets];
+	uint64_t count_;
+	uint64_t max_;
+	double sum_;
+
+};
+
+/** \brief Per-cycle timing statistics collected by LoopTimer.
+ *
+ * - lateness: wake-up time minus scheduled time.
+ * - cycle: time spent between waking up and the next call to waitForNextLoop().
+ * - overruns: cycles that were still running when the next one was due.
+ */
+struct LoopStatistics {
+
+	LoopHistogram lateness;
+	LoopHistogram cycle;
+	uint64_t overruns = 0;
+
+	void reset() {
+		lateness.reset();
+		cycle.reset();
+		overruns = 0;
+	}
+
+	/** \brief Print a one-line summary (p50/p99/p99.9/max in microseconds). */
+	void print(std::ostream& os) const;
+
+	/** \brief Summary as a string, e.g. for publishing to Redis. */
+	std::string toString() const;
+
+};
+
+#endif /* SAI_LOOPSTATISTICS_H_ */
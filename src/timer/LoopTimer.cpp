@@ -1,5 +1,13 @@
 #include "LoopTimer.h"
 
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif  // __linux__
+
+#include <iomanip>
+
 #ifndef USE_CHRONO
 // Helper timespec functions
 static inline timespec operator-(const timespec& a, const timespec& b) {
@@ -32,8 +40,121 @@ static inline timespec& operator+=(timespec& t, unsigned int nsecs) {
 static inline double timespec_to_double(const timespec& t) {
 	return t.tv_sec + 1e-9 * static_cast<double>(t.tv_nsec);
 }
+
+// Signed difference a - b in nanoseconds
+static inline int64_t timespec_diff_ns(const timespec& a, const timespec& b) {
+	return static_cast<int64_t>(a.tv_sec - b.tv_sec) * 1000000000 + (a.tv_nsec - b.tv_nsec);
+}
+
+static inline timespec ns_to_timespec(int64_t ns) {
+	timespec t;
+	t.tv_sec  = ns / 1000000000;
+	t.tv_nsec = ns % 1000000000;
+	return t;
+}
 #endif  // USE_CHRONO
 
+LoopTimer::~LoopTimer() {
+	if (timerfd_ >= 0) close(timerfd_);
+}
+
+void LoopTimer::setWaitBackend(WaitBackend backend, unsigned int spin_window_nanoseconds) {
+	ns_spin_window_ = spin_window_nanoseconds;
+#ifdef __linux__
+	if (backend == WAIT_TIMERFD && timerfd_ < 0) {
+		timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (timerfd_ < 0) {
+			printWarning("setWaitBackend. timerfd_create failed. Using WAIT_SLEEP_FOR.");
+			backend = WAIT_SLEEP_FOR;
+		}
+	}
+	wait_backend_ = backend;
+#else  // __linux__
+	if (backend != WAIT_SLEEP_FOR) {
+		printWarning(std::string("setWaitBackend. ") + waitBackendName(backend) + " is only available on Linux. Using WAIT_SLEEP_FOR.");
+	}
+	wait_backend_ = WAIT_SLEEP_FOR;
+#endif  // __linux__
+}
+
+const char* LoopTimer::waitBackendName(WaitBackend backend) {
+	switch (backend) {
+		case WAIT_SLEEP_FOR:       return "sleep_for";
+		case WAIT_CLOCK_NANOSLEEP: return "clock_nanosleep";
+		case WAIT_HYBRID_SPIN:     return "hybrid_spin";
+		case WAIT_TIMERFD:         return "timerfd";
+	}
+	return "unknown";
+}
+
+void LoopTimer::calibrateWaitBackends(double frequency, double seconds, std::ostream& os) {
+	const WaitBackend backends[] = {WAIT_SLEEP_FOR, WAIT_CLOCK_NANOSLEEP, WAIT_HYBRID_SPIN, WAIT_TIMERFD};
+	const unsigned long long num_cycles = static_cast<unsigned long long>(frequency * seconds);
+
+	os << "LoopTimer wake-up accuracy at " << frequency << " Hz, " << num_cycles << " cycles per backend:" << std::endl;
+	for (WaitBackend backend : backends) {
+		LoopTimer timer;
+		timer.setLoopFrequency(frequency);
+		timer.setWaitBackend(backend);
+		if (timer.wait_backend_ != backend) continue;
+
+		timer.initializeTimer();
+		timer.waitForNextLoop();
+		timer.resetStatistics();
+		while (timer.elapsedCycles() <= num_cycles) {
+			timer.waitForNextLoop();
+		}
+
+		const LoopHistogram& lateness = timer.statistics().lateness;
+		std::ios::fmtflags flags = os.flags();
+		os << "  " << std::left << std::setw(16) << waitBackendName(backend) << std::right
+		   << std::fixed << std::setprecision(1)
+		   << " lateness [us] p50 " << std::setw(7) << 1e6 * lateness.percentile(0.5)
+		   << " p99 " << std::setw(7) << 1e6 * lateness.percentile(0.99)
+		   << " p99.9 " << std::setw(7) << 1e6 * lateness.percentile(0.999)
+		   << " max " << std::setw(7) << 1e6 * lateness.max() << std::endl;
+		os.flags(flags);
+	}
+}
+
+void LoopTimer::sleepUntilMonotonic(int64_t ns_target) {
+#ifdef __linux__
+	timespec t_target;
+	switch (wait_backend_) {
+		case WAIT_HYBRID_SPIN: {
+			// Sleep until the spin window, then busy-wait on the clock
+			int64_t ns_sleep = ns_target - ns_spin_window_;
+			t_target.tv_sec = ns_sleep / 1000000000;
+			t_target.tv_nsec = ns_sleep % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_target, NULL);
+			timespec t_now;
+			do {
+				clock_gettime(CLOCK_MONOTONIC, &t_now);
+			} while (static_cast<int64_t>(t_now.tv_sec) * 1000000000 + t_now.tv_nsec < ns_target);
+			break;
+		}
+
+		case WAIT_TIMERFD: {
+			itimerspec t_timer = {};
+			t_timer.it_value.tv_sec = ns_target / 1000000000;
+			t_timer.it_value.tv_nsec = ns_target % 1000000000;
+			timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &t_timer, NULL);
+			uint64_t num_expirations;
+			if (read(timerfd_, &num_expirations, sizeof(num_expirations)) < 0) {
+				printWarning("sleepUntilMonotonic. timerfd read failed.");
+			}
+			break;
+		}
+
+		default:
+			t_target.tv_sec = ns_target / 1000000000;
+			t_target.tv_nsec = ns_target % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_target, NULL);
+			break;
+	}
+#endif  // __linux__
+}
+
 void LoopTimer::setLoopFrequency (double frequency) {
 #ifdef USE_CHRONO
 	ns_update_interval_ = std::chrono::nanoseconds(static_cast<unsigned int>(1e9 / frequency));
@@ -45,8 +166,9 @@ void LoopTimer::setLoopFrequency (double frequency) {
 void LoopTimer::initializeTimer(unsigned int initial_wait_nanoseconds) {
 #ifdef USE_CHRONO
 	auto ns_initial_wait = std::chrono::nanoseconds(initial_wait_nanoseconds);
-	t_next_ = std::chrono::high_resolution_clock::now() + ns_initial_wait;
+	t_next_ = currentTime() + ns_initial_wait;
 	t_start_ = t_next_;
+	t_wake_ = t_start_;
 	t_loop_ = t_start_ - t_start_;
 #else  // USE_CHRONO
 	// initialize time
@@ -55,6 +177,7 @@ void LoopTimer::initializeTimer(unsigned int initial_wait_nanoseconds) {
 	// calculate next shot. carry over nanoseconds into seconds.
 	t_next_ += initial_wait_nanoseconds;
 	t_start_ = t_next_;
+	t_wake_ = t_start_;
 	// TODO os x
 	// http://stackoverflow.com/questions/11338899/are-there-any-well-behaved-posix-interval-timers
 #endif  // USE_CHRONO
@@ -63,32 +186,62 @@ void LoopTimer::initializeTimer(unsigned int initial_wait_nanoseconds) {
 bool LoopTimer::waitForNextLoop() {
 #ifdef USE_CHRONO
 	bool slept = false;
-	t_curr_ = std::chrono::high_resolution_clock::now();
+	t_curr_ = currentTime();
+	auto t_cycle_end = t_curr_;
 	if (t_curr_ < t_next_) {
-		std::this_thread::sleep_for(t_next_ - t_curr_);
+		if (clock_) {
+			clock_->sleepUntil(std::chrono::duration_cast<std::chrono::nanoseconds>(t_next_.time_since_epoch()).count());
+		} else if (wait_backend_ == WAIT_SLEEP_FOR) {
+			std::this_thread::sleep_for(t_next_ - t_curr_);
+		} else {
+			sleepUntilMonotonic(std::chrono::duration_cast<std::chrono::nanoseconds>(t_next_.time_since_epoch()).count());
+		}
 		slept = true;
 	}
-	t_curr_ = std::chrono::high_resolution_clock::now();
+	t_curr_ = currentTime();
 	t_loop_ = t_curr_ - t_start_;
+	recordStatistics(std::chrono::duration_cast<std::chrono::nanoseconds>(t_curr_ - t_next_).count(),
+	                 std::chrono::duration_cast<std::chrono::nanoseconds>(t_cycle_end - t_wake_).count(),
+	                 t_next_ < t_cycle_end);
+	t_wake_ = t_curr_;
 	t_next_ += ns_update_interval_;
+	t_next_ += std::chrono::nanoseconds(applyOverrunPolicy(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(t_cycle_end - (t_next_ - ns_update_interval_)).count(),
+		std::chrono::duration_cast<std::chrono::nanoseconds>(t_curr_ - t_next_).count()));
 	update_counter_++;
 	return slept;
 #else  // USE_CHRONO
 	// grab the time
 	getCurrentTime(t_curr_);
+	timespec t_cycle_end = t_curr_;
 
 	// wait until next shot if necessary (this check is redundant for linux)
 	bool slept = false;
 	if (t_curr_ < t_next_) {
-		nanoSleepUntil(t_next_, t_curr_);
+		if (clock_) {
+			clock_->sleepUntil(timespec_diff_ns(t_next_, timespec{0, 0}));
+		} else if (wait_backend_ == WAIT_SLEEP_FOR) {
+			nanoSleepUntil(t_next_, t_curr_);
+		} else {
+			sleepUntilMonotonic(timespec_diff_ns(t_next_, timespec{0, 0}));
+		}
+		getCurrentTime(t_curr_);
 		slept = true;
 	}
 
 	// calculate dt
 	t_loop_ = t_curr_ - t_start_;
 
+	// record lateness of this wake-up and duration of the previous cycle
+	recordStatistics(timespec_diff_ns(t_curr_, t_next_), timespec_diff_ns(t_cycle_end, t_wake_),
+	                 t_next_ < t_cycle_end);
+	t_wake_ = t_curr_;
+
 	// calculate next shot
+	int64_t ns_overrun = timespec_diff_ns(t_cycle_end, t_next_);
 	t_next_ += ns_update_interval_;
+	int64_t ns_shift = applyOverrunPolicy(ns_overrun, timespec_diff_ns(t_curr_, t_next_));
+	if (ns_shift > 0) t_next_ = ns_to_timespec(timespec_diff_ns(t_next_, timespec{0, 0}) + ns_shift);
 
 	// increment loop counter
 	++update_counter_;
@@ -97,6 +250,85 @@ bool LoopTimer::waitForNextLoop() {
 #endif  // USE_CHRONO
 }
 
+void LoopTimer::setPhaseLock(double margin_seconds, double gain) {
+	ns_phase_margin_ = static_cast<int64_t>(1e9 * margin_seconds);
+	phase_lock_gain_ = (gain > 0 && gain <= 1) ? gain : 0.1;
+	phase_lock_ = true;
+}
+
+void LoopTimer::updatePhaseReference(double t_reference) {
+	if (!phase_lock_) return;
+
+#ifdef USE_CHRONO
+	const int64_t ns_interval = ns_update_interval_.count();
+	const int64_t ns_next = std::chrono::duration_cast<std::chrono::nanoseconds>(t_next_.time_since_epoch()).count();
+#else  // USE_CHRONO
+	const int64_t ns_interval = ns_update_interval_;
+	const int64_t ns_next = timespec_diff_ns(t_next_, timespec{0, 0});
+#endif  // USE_CHRONO
+
+	// Offset of the next tick from the desired phase, wrapped to [-T/2, T/2)
+	int64_t ns_target = static_cast<int64_t>(1e9 * t_reference) + ns_phase_margin_;
+	int64_t ns_error = (ns_next - ns_target) % ns_interval;
+	if (ns_error >= ns_interval / 2) {
+		ns_error -= ns_interval;
+	} else if (ns_error < -ns_interval / 2) {
+		ns_error += ns_interval;
+	}
+	phase_error_ = 1e-9 * ns_error;
+
+	// Correct a fraction of the error to avoid jumps from a noisy reference
+	int64_t ns_shift = -static_cast<int64_t>(phase_lock_gain_ * ns_error);
+#ifdef USE_CHRONO
+	t_next_ += std::chrono::nanoseconds(ns_shift);
+#else  // USE_CHRONO
+	t_next_ = ns_to_timespec(ns_next + ns_shift);
+#endif  // USE_CHRONO
+}
+
+int64_t LoopTimer::applyOverrunPolicy(int64_t ns_overrun, int64_t ns_behind) {
+#ifdef USE_CHRONO
+	const int64_t ns_interval = ns_update_interval_.count();
+#else  // USE_CHRONO
+	const int64_t ns_interval = ns_update_interval_;
+#endif  // USE_CHRONO
+
+	// Ticks after this one that are already due
+	unsigned long long missed_ticks = (ns_behind >= 0) ? ns_behind / ns_interval + 1 : 0;
+
+	if (overrun_callback_ && ns_overrun > 0 && update_counter_ > 0) {
+		overrun_callback_(1e-9 * ns_overrun, missed_ticks);
+	}
+	if (missed_ticks == 0) return 0;
+
+	switch (overrun_policy_) {
+		case OVERRUN_SKIP:
+			// Stay on the original phase and drop the missed ticks
+			return missed_ticks * ns_interval;
+		case OVERRUN_REPHASE:
+			// Next tick one interval from now
+			return ns_behind + ns_interval;
+		default:
+			// Run the missed ticks back-to-back
+			return 0;
+	}
+}
+
+void LoopTimer::recordStatistics(int64_t ns_lateness, int64_t ns_cycle, bool overrun) {
+	stats_.lateness.record(ns_lateness);
+
+	// The first call has no previous cycle to measure
+	if (update_counter_ > 0) {
+		stats_.cycle.record(ns_cycle);
+		if (overrun) ++stats_.overruns;
+	}
+
+	if (stats_callback_ && stats_period_ > 0 && loopTime() >= stats_next_) {
+		stats_callback_(stats_);
+		stats_next_ += stats_period_;
+	}
+}
+
 unsigned long long LoopTimer::elapsedCycles() {
 	return update_counter_;
 }
@@ -120,6 +352,8 @@ double LoopTimer::elapsedTime() {
 }
 
 double LoopTimer::elapsedSimTime() {
+	// With an external clock, simulation time is the clock's own time
+	if (clock_) return loopTime();
 #ifdef USE_CHRONO
 	return update_counter_ * std::chrono::duration<double>(ns_update_interval_).count();
 #else  // USE_CHRONO
@@ -140,7 +374,7 @@ void LoopTimer::elapsedTime(timespec& t) {
 #endif  // USE_CHRONO
 
 
-void LoopTimer::run(void (*userCallback)(void)) {
+void LoopTimer::run(std::function<void(void)> userCallback) {
 #ifdef USE_CHRONO
 	initializeTimer(ns_update_interval_.count());
 #else  // USE_CHRONO
@@ -189,8 +423,19 @@ void LoopTimer::stop() {
 //     memset(dummy, 0, MAX_SAFE_STACK);
 // }
 
-#ifndef USE_CHRONO
+#ifdef USE_CHRONO
+inline LoopTimer::Clock::time_point LoopTimer::currentTime() {
+	if (clock_) {
+		return Clock::time_point(std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(clock_->now())));
+	}
+	return Clock::now();
+}
+#else  // USE_CHRONO
 inline void LoopTimer::getCurrentTime(timespec &t_ret) {
+	if (clock_) {
+		t_ret = ns_to_timespec(clock_->now());
+		return;
+	}
 #ifdef __APPLE__
 	static double ratio = 0.0;
 	if (!ratio) {
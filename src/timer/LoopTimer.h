@@ -3,8 +3,13 @@
 #ifndef SAI_LOOPTIMER_H_
 #define SAI_LOOPTIMER_H_
 
+#include "LoopClock.h"
+#include "LoopStatistics.h"
+
 #include <string>
 #include <iostream>
+#include <functional>
+#include <memory>
 #include <signal.h>
 
 #define USE_CHRONO
@@ -29,24 +34,132 @@ class LoopTimer {
 
 public:
 
+	/** \brief Method used by waitForNextLoop() to sleep until the next loop.
+	 *
+	 * - WAIT_SLEEP_FOR:        relative sleep (std::this_thread::sleep_for). Default.
+	 * - WAIT_CLOCK_NANOSLEEP:  absolute clock_nanosleep on CLOCK_MONOTONIC.
+	 * - WAIT_HYBRID_SPIN:      clock_nanosleep until the spin window before the
+	 *                          deadline, then busy-wait. Burns CPU for accuracy.
+	 * - WAIT_TIMERFD:          absolute timerfd on CLOCK_MONOTONIC.
+	 *
+	 * All but WAIT_SLEEP_FOR are Linux only.
+	 */
+	enum WaitBackend {
+		WAIT_SLEEP_FOR,
+		WAIT_CLOCK_NANOSLEEP,
+		WAIT_HYBRID_SPIN,
+		WAIT_TIMERFD
+	};
+
+	/** \brief What waitForNextLoop() does with ticks that were missed during an overrun.
+	 *
+	 * - OVERRUN_CATCH_UP:  run the missed ticks back-to-back without waiting. Default.
+	 * - OVERRUN_SKIP:      drop the missed ticks and wait for the next tick on the original phase.
+	 * - OVERRUN_REPHASE:   drop the missed ticks and schedule the next tick one period from now.
+	 */
+	enum OverrunPolicy {
+		OVERRUN_CATCH_UP,
+		OVERRUN_SKIP,
+		OVERRUN_REPHASE
+	};
+
 	LoopTimer() {}
 
-	virtual ~LoopTimer() {}
+	virtual ~LoopTimer();
+
+	LoopTimer(const LoopTimer&) = delete;
+	LoopTimer& operator=(const LoopTimer&) = delete;
 
 	/** \brief Set the loop frequency
 	 * \param frequency The loop frequency that will be used for LoopTimer::run()
 	 */
 	void setLoopFrequency (double frequency);
 
+	/** \brief Select how waitForNextLoop() sleeps.
+	 * \param backend The wait backend. Falls back to WAIT_SLEEP_FOR if unavailable.
+	 * \param spin_window_nanoseconds Busy-wait window before the deadline for WAIT_HYBRID_SPIN.
+	 */
+	void setWaitBackend(WaitBackend backend, unsigned int spin_window_nanoseconds = 100000);
+
+	/** \brief Measure the wake-up accuracy of every wait backend on this host and print a report.
+	 * \param frequency Loop frequency to test at.
+	 * \param seconds Duration to run each backend for.
+	 * \param os Stream for the report.
+	 */
+	static void calibrateWaitBackends(double frequency = 1000, double seconds = 2, std::ostream& os = std::cout);
+
+	/** \brief Name of a wait backend, for printing. */
+	static const char* waitBackendName(WaitBackend backend);
+
+	/** \brief Run the timer against an external clock instead of the host clock.
+	 *
+	 * With a SimulationClock, waitForNextLoop() returns as soon as the
+	 * simulation time reaches the next tick, and the elapsed and loop times
+	 * are simulation times. The wait backend is unused. Call before
+	 * initializeTimer(). Pass nullptr to return to the host clock.
+	 */
+	void setClock(std::shared_ptr<LoopClock> clock) { clock_ = clock; }
+
+	/** \brief Lock the loop phase to an external periodic source, e.g. the robot driver.
+	 *
+	 * Once enabled, every call to updatePhaseReference() nudges the next
+	 * wake-up towards margin_seconds after the source's publish phase. The
+	 * source must run at the same frequency as this loop.
+	 * \param margin_seconds Delay of the wake-up after the source publishes.
+	 * \param gain Fraction of the phase error corrected per update, in (0, 1].
+	 */
+	void setPhaseLock(double margin_seconds, double gain = 0.1);
+
+	/** \brief Disable the phase lock. */
+	void clearPhaseLock() { phase_lock_ = false; }
+
+	/** \brief Report when the source published its latest sample.
+	 * \param t_reference Publish time in seconds on the timer's clock
+	 *        (CLOCK_MONOTONIC unless an external clock is set).
+	 */
+	void updatePhaseReference(double t_reference);
+
+	/** \brief Last measured offset of the wake-up from the locked phase in seconds. */
+	double phaseError() const { return phase_error_; }
+
+	/** \brief Select how missed ticks are handled after an overrun. */
+	void setOverrunPolicy(OverrunPolicy policy) { overrun_policy_ = policy; }
+
+	/** \brief Call a function from waitForNextLoop() whenever the previous cycle overran its period.
+	 * \param callback Called with the time the cycle ran past its deadline in seconds,
+	 *        and the number of following ticks that were already due when the loop woke up
+	 *        (dropped unless the policy is OVERRUN_CATCH_UP).
+	 */
+	void setOverrunCallback(std::function<void(double overrun_seconds, unsigned long long missed_ticks)> callback) {
+		overrun_callback_ = callback;
+	}
+
 	/** \brief Initialize the timing loop, if using your own while loop. call before waitForLoop.
 	 * \param initial_wait_nanoseconds The delay before waitForNextLoop will return the first time
 	 */
 	void initializeTimer(unsigned int initial_wait_nanoseconds = 0);
 
 	/** \brief Wait for next loop. Use in your while loop. Not needed if using LoopTimer::run().
+	 * Records wake-up lateness, cycle duration and overruns in statistics().
 	 * \return true if a wait was required, and false if no wait was required. */
 	bool waitForNextLoop();
 
+	/** \brief Timing statistics recorded by waitForNextLoop(). */
+	const LoopStatistics& statistics() const { return stats_; }
+
+	/** \brief Clear the timing statistics, e.g. after a warm-up phase. */
+	void resetStatistics() { stats_.reset(); }
+
+	/** \brief Call a function with the timing statistics periodically from waitForNextLoop().
+	 * \param period_seconds Loop time between calls. Set to 0 to disable.
+	 * \param callback Function to call, e.g. to print or publish the statistics.
+	 */
+	void setStatisticsCallback(double period_seconds, std::function<void(const LoopStatistics&)> callback) {
+		stats_period_ = period_seconds;
+		stats_next_ = period_seconds;
+		stats_callback_ = callback;
+	}
+
 	/** \brief Number of loops since calling run. */
 	unsigned long long elapsedCycles();
 
@@ -56,7 +169,8 @@ public:
 	/** \brief Elapsed computer time since calling initializeTimer() or run() in seconds. */
 	double elapsedTime();
 
-	/** \brief Elapsed simulation time since calling initializeTimer() or run() in seconds. */
+	/** \brief Elapsed simulation time since calling initializeTimer() or run() in seconds.
+	 * Number of loops times the loop period, or the external clock's time if one is set. */
 	double elapsedSimTime();
 
 #ifndef USE_CHRONO
@@ -70,7 +184,7 @@ public:
 	/** \brief Run a loop that calls the user_callback(). Blocking function.
 	 * \param userCallback A function to call every loop.
 	 */
-	void run(void (*userCallback)(void));
+	void run(std::function<void(void)> userCallback);
 
 	/** \brief Stop the loop, started by run(). Use within callback, or from a seperate thread. */
 	void stop();
@@ -98,12 +212,26 @@ public:
 
 protected:
 
-#ifndef USE_CHRONO
+#ifdef USE_CHRONO
+	// steady_clock is CLOCK_MONOTONIC on Linux, as required by the absolute wait backends
+	typedef std::chrono::steady_clock Clock;
+
+	inline Clock::time_point currentTime();
+#else  // USE_CHRONO
 	inline void getCurrentTime(timespec &t_ret);
 
 	inline void nanoSleepUntil(const timespec &t_next, const timespec &t_now);
 #endif  // !USE_CHRONO
 
+	/** \brief Sleep until an absolute CLOCK_MONOTONIC time with the selected backend. */
+	void sleepUntilMonotonic(int64_t ns_target);
+
+	/** \brief Call the overrun callback and return the shift to apply to the next tick. */
+	int64_t applyOverrunPolicy(int64_t ns_overrun, int64_t ns_behind);
+
+	/** \brief Record the timings of one cycle and trigger the statistics callback. */
+	void recordStatistics(int64_t ns_lateness, int64_t ns_cycle, bool overrun);
+
 	static void printWarning(const std::string& message) {
 		std::cout << "WARNING. LoopTimer. " << message << std::endl;
 	}
@@ -111,14 +239,16 @@ protected:
 	volatile bool running_ = false;
 
 #ifdef USE_CHRONO
-	std::chrono::high_resolution_clock::time_point t_next_;
-	std::chrono::high_resolution_clock::time_point t_curr_;
-	std::chrono::high_resolution_clock::time_point t_start_;
-	std::chrono::high_resolution_clock::duration t_loop_;
+	Clock::time_point t_next_;
+	Clock::time_point t_curr_;
+	Clock::time_point t_wake_;
+	Clock::time_point t_start_;
+	Clock::duration t_loop_;
 	std::chrono::nanoseconds ns_update_interval_;
 #else  // USE_CHRONO
 	struct timespec t_next_;
 	struct timespec t_curr_;
+	struct timespec t_wake_;
 	struct timespec t_start_;
 	struct timespec t_loop_;
 	unsigned int ns_update_interval_ = 1e9 / 1000; // 1000 Hz
@@ -126,6 +256,25 @@ protected:
 
 	unsigned long long update_counter_ = 0;
 
+	WaitBackend wait_backend_ = WAIT_SLEEP_FOR;
+	int64_t ns_spin_window_ = 100000;
+	int timerfd_ = -1;
+
+	std::shared_ptr<LoopClock> clock_;
+
+	bool phase_lock_ = false;
+	int64_t ns_phase_margin_ = 0;
+	double phase_lock_gain_ = 0.1;
+	double phase_error_ = 0.0;
+
+	OverrunPolicy overrun_policy_ = OVERRUN_CATCH_UP;
+	std::function<void(double, unsigned long long)> overrun_callback_;
+
+	LoopStatistics stats_;
+	std::function<void(const LoopStatistics&)> stats_callback_;
+	double stats_period_ = 0.0;
+	double stats_next_ = 0.0;
+
 };
 
 #endif /* SAI_LOOPTIMER_H_ */
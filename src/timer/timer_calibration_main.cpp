@@ -0,0 +1,20 @@
+// Reports the wake-up accuracy of each LoopTimer wait backend on this host
+
+#include "timer/LoopTimer.h"
+
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char** argv) {
+	if (argc > 3) {
+		std::cout << "Usage: timer_calibration [frequency (default 1000)] [seconds per backend (default 2)]" << std::endl;
+		exit(0);
+	}
+
+	double frequency = (argc > 1) ? atof(argv[1]) : 1000;
+	double seconds   = (argc > 2) ? atof(argv[2]) : 2;
+
+	LoopTimer::calibrateWaitBackends(frequency, seconds);
+
+	return 0;
+}